@@ -0,0 +1,204 @@
+#!/usr/bin/env python3
+"""Generates synthetic C programs for measuring instrumentation overhead.
+
+Each shape stresses a different part of the instrumentation:
+
+  recursion  deep recursive calls, counted on entry
+  leaf-loop  a tight loop of calls to a tiny function
+  libc       many calls to external library functions, counted at call sites
+  threads    calls to shared functions from many threads at once
+  functions  a very large number of functions, for table sizes and compile time
+
+The amount of work scales with --scale, so that the plain programs run long
+enough to time reliably on the machine at hand.
+"""
+
+import argparse
+import sys
+
+
+SHAPES = ["recursion", "leaf-loop", "libc", "threads", "functions"]
+
+PRELUDE = """\
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NOINLINE __attribute__((noinline))
+
+volatile unsigned long sink;
+"""
+
+
+def recursion(scale, options):
+    depth = options.depth
+    return PRELUDE + f"""
+NOINLINE unsigned long
+walk(unsigned depth) {{
+  if (!depth) {{
+    return 1;
+  }}
+  // Using the result keeps the recursion from becoming a loop.
+  unsigned long result = walk(depth - 1);
+  sink = result;
+  return result + (depth & 1);
+}}
+
+int
+main(void) {{
+  for (unsigned long i = 0; i < {200 * scale}; ++i) {{
+    sink += walk({depth});
+  }}
+  return 0;
+}}
+"""
+
+
+def leaf_loop(scale, options):
+    return PRELUDE + f"""
+NOINLINE unsigned long
+leaf(unsigned long x) {{
+  return x * 2654435761u >> 7;
+}}
+
+int
+main(void) {{
+  unsigned long total = 0;
+  for (unsigned long i = 0; i < {10000000 * scale}ul; ++i) {{
+    total += leaf(i);
+  }}
+  sink = total;
+  return 0;
+}}
+"""
+
+
+def libc(scale, options):
+    # Built with -fno-builtin, so the calls reach the library.
+    return PRELUDE + f"""
+int
+main(void) {{
+  char buffer[64];
+  unsigned long total = 0;
+  memset(buffer, 'x', sizeof(buffer) - 1);
+  buffer[sizeof(buffer) - 1] = '\\0';
+  for (unsigned long i = 0; i < {500000 * scale}ul; ++i) {{
+    buffer[i % 32] = 'a' + i % 26;
+    total += strlen(buffer);
+    total += labs((long)i - 1000);
+    total += strchr(buffer, 'q') != NULL;
+  }}
+  sink = total;
+  return 0;
+}}
+"""
+
+
+def threads(scale, options):
+    return PRELUDE + f"""
+#include <pthread.h>
+
+NOINLINE unsigned long
+leaf(unsigned long x) {{
+  return x * 2654435761u >> 7;
+}}
+
+NOINLINE unsigned long
+middle(unsigned long x) {{
+  return leaf(x) + leaf(x + 1);
+}}
+
+void*
+work(void* arg) {{
+  unsigned long total = 0;
+  for (unsigned long i = 0; i < {500000 * scale}ul; ++i) {{
+    total += middle(i);
+  }}
+  sink = total;
+  return arg;
+}}
+
+int
+main(void) {{
+  pthread_t threads[{options.threads}];
+  for (int i = 0; i < {options.threads}; ++i) {{
+    pthread_create(&threads[i], NULL, work, NULL);
+  }}
+  for (int i = 0; i < {options.threads}; ++i) {{
+    pthread_join(threads[i], NULL);
+  }}
+  return 0;
+}}
+"""
+
+
+def functions(scale, options):
+    count  = options.functions
+    groups = (count + 99) // 100
+    parts  = [PRELUDE]
+    for i in range(count):
+        parts.append(f"NOINLINE void f{i}(void) {{ sink += {i}; }}\n")
+    for g in range(groups):
+        calls = "".join(f"  f{i}();\n" for i in range(g * 100, min(count, g * 100 + 100)))
+        parts.append(f"NOINLINE void group{g}(void) {{\n{calls}}}\n")
+    calls = "".join(f"    group{g}();\n" for g in range(groups))
+    parts.append(f"""
+int
+main(void) {{
+  for (unsigned i = 0; i < {10 * scale}; ++i) {{
+{calls}  }}
+  return 0;
+}}
+""")
+    return "".join(parts)
+
+
+GENERATORS = {
+    "recursion": recursion,
+    "leaf-loop": leaf_loop,
+    "libc":      libc,
+    "threads":   threads,
+    "functions": functions,
+}
+
+# Extra flags needed when compiling a shape.
+CFLAGS = {
+    "libc":    ["-fno-builtin"],
+    "threads": ["-pthread"],
+}
+
+
+def add_shape_options(parser):
+    parser.add_argument("--scale", type=int, default=10,
+                        help="multiplier for the amount of work (default 10)")
+    parser.add_argument("--depth", type=int, default=10000,
+                        help="recursion depth of the recursion shape")
+    parser.add_argument("--threads", type=int, default=8,
+                        help="number of threads of the threads shape")
+    parser.add_argument("--functions", type=int, default=100000,
+                        help="number of functions of the functions shape")
+
+
+def generate(shape, options):
+    return GENERATORS[shape](options.scale, options)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("shape", choices=SHAPES)
+    parser.add_argument("-o", dest="output", default="-",
+                        help="file to write the program to (default stdout)")
+    add_shape_options(parser)
+    options = parser.parse_args()
+
+    source = generate(options.shape, options)
+    if "-" == options.output:
+        sys.stdout.write(source)
+    else:
+        with open(options.output, "w") as out:
+            out.write(source)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+"""Measures the overhead of each callcounter instrumentation strategy.
+
+Every shape from generate.py is compiled to bitcode once, built as a plain
+program, and instrumented with each configuration. The report lists, per
+shape and configuration:
+
+  runtime    the fastest of --repeat runs of the program
+  slowdown   the runtime relative to the plain program
+  size       the size of the program and its growth over the plain program
+  tool       the time and peak memory of callcounter while instrumenting
+
+Instrumented programs write their profiles to a scratch file, so the report
+at exit is not dominated by printing.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+import generate
+
+
+CONFIGS = {
+    "inline":       ["-dynamic"],
+    "call":         ["-dynamic", "-counter-update=call"],
+    "atomic":       ["-dynamic", "-counter-mode=atomic"],
+    "thread-local": ["-dynamic", "-counter-mode=thread-local"],
+    "coalesced":    ["-dynamic", "-coalesce-counters", "-promote-loop-counters"],
+    "sampled":      ["-dynamic", "-sampling=countdown", "-sample-period=1000"],
+    "window":       ["-dynamic", "-sampling=window", "-sample-period=10"],
+    "edges":        ["-dynamic", "-count-edges"],
+    "indirect":     ["-dynamic", "-profile-indirect"],
+    "continuous":   ["-dynamic", "-continuous"],
+    "timing":       ["-timing"],
+}
+
+
+def run_measured(command, env=None):
+    """Runs a command and returns its wall time and peak memory in MiB."""
+    # A pipe would block the command once it fills, as nothing reads it
+    # until the command has exited.
+    with tempfile.TemporaryFile() as stderr:
+        start   = time.perf_counter()
+        process = subprocess.Popen(command,
+                                   env=env,
+                                   stdout=subprocess.DEVNULL,
+                                   stderr=stderr)
+        _, status, usage = os.wait4(process.pid, 0)
+        elapsed = time.perf_counter() - start
+        stderr.seek(0)
+        errors = stderr.read().decode(errors="replace")
+    process.returncode = os.waitstatus_to_exitcode(status)
+    if process.returncode:
+        sys.exit(f"Command failed ({process.returncode}): {' '.join(command)}\n{errors}")
+    return elapsed, usage.ru_maxrss / 1024
+
+
+def time_program(path, repeat, env):
+    return min(run_measured([path], env)[0] for _ in range(repeat))
+
+
+def benchmark_shape(shape, options, env):
+    directory = os.path.join(options.work_dir, shape)
+    os.makedirs(directory, exist_ok=True)
+
+    source  = os.path.join(directory, shape + ".c")
+    bitcode = os.path.join(directory, shape + ".bc")
+    plain   = os.path.join(directory, shape + ".plain")
+    with open(source, "w") as out:
+        out.write(generate.generate(shape, options))
+
+    cflags = ["-O2", "-g0"] + generate.CFLAGS.get(shape, [])
+    run_measured([options.clang] + cflags + ["-c", "-emit-llvm", source, "-o", bitcode])
+    run_measured([options.clang] + cflags + [bitcode, "-o", plain, "-lpthread"])
+
+    baseline = time_program(plain, options.repeat, env)
+    baseSize = os.path.getsize(plain)
+    results  = [{
+        "shape": shape, "config": "plain", "runtime": baseline, "slowdown": 1.0,
+        "size": baseSize, "growth": 0.0, "toolTime": 0.0, "toolMemory": 0.0,
+    }]
+
+    for config in options.configs:
+        program = os.path.join(directory, f"{shape}.{config}")
+        toolTime, toolMemory = run_measured(
+            [options.callcounter] + CONFIGS[config]
+            + [bitcode, "-o", program])
+        runtime = time_program(program, options.repeat, env)
+        size    = os.path.getsize(program)
+        results.append({
+            "shape": shape, "config": config, "runtime": runtime,
+            "slowdown": runtime / baseline if baseline else 0.0,
+            "size": size, "growth": 100.0 * (size - baseSize) / baseSize,
+            "toolTime": toolTime, "toolMemory": toolMemory,
+        })
+    return results
+
+
+def print_report(results):
+    header = (f"{'shape':<10} {'config':<13} {'runtime':>9} {'slowdown':>9} "
+              f"{'size KiB':>9} {'growth':>8} {'tool s':>8} {'tool MiB':>9}")
+    print(header)
+    print("=" * len(header))
+    for r in results:
+        print(f"{r['shape']:<10} {r['config']:<13} {r['runtime']:>8.3f}s "
+              f"{r['slowdown']:>8.2f}x {r['size'] / 1024:>9.0f} "
+              f"{r['growth']:>7.1f}% {r['toolTime']:>8.2f} {r['toolMemory']:>9.0f}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--callcounter", required=True,
+                        help="path to the callcounter tool")
+    parser.add_argument("--clang", default="clang",
+                        help="clang used to build the bitcode and plain programs")
+    parser.add_argument("--work-dir", default="bench-work",
+                        help="directory for the generated programs")
+    parser.add_argument("--shapes", nargs="+", choices=generate.SHAPES,
+                        default=generate.SHAPES)
+    parser.add_argument("--configs", nargs="+", choices=list(CONFIGS),
+                        default=list(CONFIGS))
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="runs of each program, of which the fastest counts")
+    parser.add_argument("--json", help="also write the results to this file")
+    generate.add_shape_options(parser)
+    options = parser.parse_args()
+
+    env = dict(os.environ)
+    env["CALLCOUNTER_PROFILE"] = os.path.join(os.path.abspath(options.work_dir),
+                                              "scratch.prof")
+
+    results = []
+    for shape in options.shapes:
+        results += benchmark_shape(shape, options, env)
+    print_report(results)
+
+    if options.json:
+        with open(options.json, "w") as out:
+            json.dump(results, out, indent=2)
+
+
+if __name__ == "__main__":
+    main()
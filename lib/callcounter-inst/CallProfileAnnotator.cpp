@@ -0,0 +1,132 @@
+
+
+#include "llvm/ADT/MapVector.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/ProfileSummary.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "CallProfileAnnotator.h"
+
+
+using namespace llvm;
+using callcounter::CallProfileAnnotator;
+
+
+namespace {
+
+
+// A direct call site, with the frequency of its block relative to the entry
+// of its caller.
+struct CallSite {
+  CallBase* cb;
+  Function* callee;
+  double frequency;
+};
+
+
+}  // namespace
+
+
+static std::vector<CallSite>
+collectCallSites(Function& f, BlockFrequencyInfo& bfi) {
+  std::vector<CallSite> sites;
+  double entry = bfi.getEntryFreq().getFrequency();
+  for (auto& bb : f) {
+    double frequency = bfi.getBlockFreq(&bb).getFrequency() / entry;
+    for (auto& i : bb) {
+      auto* cb = dyn_cast<CallBase>(&i);
+      if (!cb) {
+        continue;
+      }
+      auto* called = dyn_cast<Function>(cb->getCalledOperand()->stripPointerCasts());
+      if (called && !called->isIntrinsic()) {
+        sites.push_back({cb, called, frequency});
+      }
+    }
+  }
+  return sites;
+}
+
+
+PreservedAnalyses
+CallProfileAnnotator::run(Module& m, ModuleAnalysisManager& mam) {
+  auto& fam = mam.getResult<FunctionAnalysisManagerModuleProxy>(m).getManager();
+
+  bool hasEdges = llvm::any_of(counts, [](auto& entry) {
+    return entry.getKey().contains(" -> ");
+  });
+  auto getGroup = [hasEdges](Function& caller, Function& callee) {
+    return hasEdges ? (caller.getName() + " -> " + callee.getName()).str()
+                    : callee.getName().str();
+  };
+
+  // Only calls are measured, so each direct call site is weighed with its
+  // share of the calls, split among the sites by their estimated counts. With
+  // edge counts, the calls of each caller and callee pair are split among the
+  // sites of the pair. Otherwise, the calls of each callee are split among
+  // all of its direct call sites in profiled functions.
+  MapVector<Function*, std::pair<uint64_t, std::vector<CallSite>>> profiled;
+  StringMap<double> groupTotals;
+  for (auto& f : m) {
+    auto found = counts.find(f.getName());
+    if (f.isDeclaration() || found == counts.end()) {
+      continue;
+    }
+    f.setEntryCount(Function::ProfileCount(found->second, Function::PCT_Real));
+
+    auto& [entryCount, sites] = profiled[&f];
+    entryCount = found->second;
+    sites      = collectCallSites(f, fam.getResult<BlockFrequencyAnalysis>(f));
+    for (auto& site : sites) {
+      groupTotals[getGroup(f, *site.callee)] +=
+          site.frequency * (hasEdges ? 1 : entryCount);
+    }
+  }
+
+  // The weights of the call sites also make up the summary, which is marked as
+  // a sample profile. Only for those are the counts of call sites taken from
+  // the sites themselves instead of from the estimated counts of their blocks.
+  // Sites without measured calls fall back to their estimates.
+  InstrProfSummaryBuilder builder{ProfileSummaryBuilder::DefaultCutoffs};
+  MDBuilder md{m.getContext()};
+  for (auto& [f, profile] : profiled) {
+    auto& [entryCount, sites] = profile;
+
+    // The first count of a record is that of the entry.
+    InstrProfRecord record{{entryCount}};
+    for (auto& site : sites) {
+      auto group    = getGroup(*f, *site.callee);
+      auto measured = counts.find(group);
+      double weight = entryCount * site.frequency;
+      if (measured != counts.end()) {
+        double share = hasEdges ? site.frequency : weight;
+        double total = groupTotals.lookup(group);
+        weight       = total ? measured->second * share / total : 0;
+      }
+
+      auto clamped = static_cast<uint32_t>(
+          std::min<double>(weight, std::numeric_limits<uint32_t>::max()));
+      site.cb->setMetadata(LLVMContext::MD_prof, md.createBranchWeights({clamped}));
+      record.Counts.push_back(clamped);
+    }
+    builder.addRecord(record);
+  }
+
+  auto built = builder.getSummary();
+  ProfileSummary summary{ProfileSummary::PSK_Sample,
+                         built->getDetailedSummary(),
+                         built->getTotalCount(),
+                         built->getMaxCount(),
+                         built->getMaxInternalCount(),
+                         built->getMaxFunctionCount(),
+                         built->getNumCounts(),
+                         built->getNumFunctions()};
+  m.setProfileSummary(summary.getMD(m.getContext()), ProfileSummary::PSK_Sample);
+  return PreservedAnalyses::none();
+}
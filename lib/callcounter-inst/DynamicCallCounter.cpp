@@ -1,10 +1,18 @@
 
 
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
 #include "DynamicCallCounter.h"
+#include "ProfileFormat.h"
 
 
 using namespace llvm;
@@ -41,52 +49,45 @@ computeInternal(llvm::ArrayRef<Function*> functions) {
 }
 
 
-static llvm::Constant*
-createConstantString(llvm::Module& m, llvm::StringRef str) {
-  auto& context = m.getContext();
+// Assigns a counter ID to each (caller, callee) pair of direct calls that are
+// counted by their edges, starting at `firstID`.
+static MapVector<std::pair<Function*, Function*>, uint64_t>
+computeEdgeIDs(llvm::ArrayRef<Function*> functions,
+               function_ref<Function*(CallBase&)> getEdgeCallee,
+               uint64_t firstID) {
+  MapVector<std::pair<Function*, Function*>, uint64_t> edgeIDs;
 
-  auto* name    = llvm::ConstantDataArray::getString(context, str, true);
-  auto* int8Ty  = llvm::Type::getInt8Ty(context);
-  auto* arrayTy = llvm::ArrayType::get(int8Ty, str.size() + 1);
-  auto* asStr   = new llvm::GlobalVariable(
-      m, arrayTy, true, llvm::GlobalValue::PrivateLinkage, name);
+  for (auto f : functions) {
+    for (auto& bb : *f) {
+      for (auto& i : bb) {
+        auto* cb = dyn_cast<CallBase>(&i);
+        if (!cb) {
+          continue;
+        }
+        if (auto* called = getEdgeCallee(*cb)) {
+          edgeIDs.insert({{f, called}, firstID + edgeIDs.size()});
+        }
+      }
+    }
+  }
 
-  auto* zero = llvm::ConstantInt::get(llvm::Type::getInt32Ty(context), 0);
-  llvm::Value* indices[] = {zero, zero};
-  return llvm::ConstantExpr::getInBoundsGetElementPtr(arrayTy, asStr, indices);
+  return edgeIDs;
 }
 
 
-// Create the CCOUNT(functionInfo) table used by the runtime library.
-static void
-createFunctionTable(Module& m, uint64_t numFunctions) {
-  auto& context = m.getContext();
-
-  // Create the component types of the table
-  auto* int64Ty    = Type::getInt64Ty(context);
-  auto* stringTy   = PointerType::get(context, 0);
-  Type* fieldTys[] = {stringTy, int64Ty};
-  auto* structTy   = StructType::get(context, fieldTys, false);
-  auto* tableTy    = ArrayType::get(structTy, numFunctions);
-  auto* zero       = ConstantInt::get(int64Ty, 0, false);
-
-  // Compute and store an externally visible array of function information.
-  std::vector<Constant*> values;
-  std::transform(
-      m.begin(),
-      m.end(),
-      std::back_inserter(values),
-      [&m, zero, structTy](auto& f) {
-        Constant* structFields[] = {createConstantString(m, f.getName()), zero};
-        return ConstantStruct::get(structTy, structFields);
-      });
-  auto* functionTable = ConstantArray::get(tableTy, values);
-  new GlobalVariable(m,
-                     tableTy,
-                     false,
-                     GlobalValue::ExternalLinkage,
-                     functionTable,
-                     "CaLlCoUnTeR_functionInfo");
+// The body of a function is moved into a new function that the original
+// forwards to with a tail call. This rules out variadic functions, arguments
+// that cannot be forwarded, and blocks whose addresses are taken.
+static bool
+canSplitEntry(const Function& f) {
+  return !f.isVarArg() && !f.hasFnAttribute(Attribute::Naked) && !f.hasPrefixData()
+         && !f.hasPrologueData()
+         && llvm::none_of(f.args(),
+                          [](const Argument& arg) {
+                            return arg.hasInAllocaAttr() || arg.hasPreallocatedAttr()
+                                   || arg.hasSwiftErrorAttr();
+                          })
+         && llvm::none_of(f, [](const BasicBlock& bb) { return bb.hasAddressTaken(); });
 }
 
 
@@ -95,36 +96,131 @@ DynamicCallCounter::run(Module& m, ModuleAnalysisManager& mam) {
   auto& context = m.getContext();
 
   // First identify the functions we wish to track
-  std::vector<Function*> toCount;
-  for (auto& f : m) {
-    toCount.push_back(&f);
+  auto toCount = selectFunctions(m);
+
+  ids      = computeFunctionIDs(toCount);
+  internal = computeInternal(toCount);
+
+  std::vector<std::string> names;
+  for (auto f : toCount) {
+    names.push_back(f->getName().str());
   }
 
-  ids                     = computeFunctionIDs(toCount);
-  internal                = computeInternal(toCount);
-  auto const numFunctions = toCount.size();
+  // Edge counters follow the function counters and are named after both ends.
+  // Functions that may also be entered from elsewhere are split when direct
+  // calls count their edges, so that those calls bypass the entry counter.
+  edgeIDs.clear();
+  enteredElsewhere.clear();
+  splitCalls.clear();
+  if (options.countEdges) {
+    for (auto f : toCount) {
+      if (!f->isDeclaration() && isEnteredElsewhere(*f)) {
+        enteredElsewhere.insert(f);
+      }
+    }
+    edgeIDs = computeEdgeIDs(
+        toCount, [this](CallBase& cb) { return getEdgeCallee(cb); }, names.size());
+    for (auto& [edge, id] : edgeIDs) {
+      names.push_back((edge.first->getName() + " -> " + edge.second->getName()).str());
+      if (enteredElsewhere.count(edge.second)) {
+        splitCalls[edge.second];
+      }
+    }
+  }
 
-  // Store the number of functions into an externally visible variable.
-  auto* int64Ty            = Type::getInt64Ty(context);
-  auto* numFunctionsGlobal = ConstantInt::get(int64Ty, numFunctions, false);
-  new GlobalVariable(m,
-                     int64Ty,
-                     true,
-                     GlobalValue::ExternalLinkage,
-                     numFunctionsGlobal,
-                     "CaLlCoUnTeR_numFunctions");
+  // Functions are counted on entry where they are defined and at their call
+  // sites otherwise, which the runtime needs to know when merging modules.
+  std::vector<uint8_t> kinds;
+  for (auto f : toCount) {
+    kinds.push_back(f->isDeclaration() ? profile::CALL_COUNTER
+                                       : profile::ENTRY_COUNTER);
+  }
+  kinds.resize(names.size(), profile::EDGE_COUNTER);
 
-  createFunctionTable(m, numFunctions);
+  // The descriptor is filled in once all tables are known, but the updates
+  // of the runtime library refer to it while instrumenting.
+  auto* int64Ty = Type::getInt64Ty(context);
+  auto* ptrTy   = PointerType::get(context, 0);
+  auto* infoTy  = StructType::get(context,
+                                 {int64Ty, ptrTy, ptrTy, ptrTy, ptrTy, int64Ty,
+                                  ptrTy, int64Ty, ptrTy, ptrTy, ptrTy, int64Ty});
+  moduleInfo    = new GlobalVariable(m,
+                                  infoTy,
+                                  true,
+                                  GlobalValue::InternalLinkage,
+                                  nullptr,
+                                  "CaLlCoUnTeR_module");
+
+  createCounterTables(m, names, kinds);
+  derivedEdges = nullptr;
+  if (options.countEdges) {
+    createEdgeTable(m);
+  }
 
-  // Install the result printing function so that it prints out the counts after
-  // the entire program is finished executing.
   auto* voidTy = Type::getVoidTy(context);
-  auto printer = m.getOrInsertFunction("CaLlCoUnTeR_print", voidTy);
-  appendToGlobalDtors(m, llvm::cast<Function>(printer.getCallee()), 0);
 
-  // Declare the counter function
-  auto* helperTy = FunctionType::get(voidTy, int64Ty, false);
-  auto counter   = m.getOrInsertFunction("CaLlCoUnTeR_called", helperTy);
+  // Declare the counter functions matching the counter mode when updates go
+  // through the runtime. Only coalescing and promotion add more than one.
+  counter = nullptr;
+  adder   = nullptr;
+  if (CounterUpdate::CALL == options.update) {
+    auto* helperTy = FunctionType::get(voidTy, {ptrTy, int64Ty}, false);
+    auto* adderTy  = FunctionType::get(voidTy, {ptrTy, int64Ty, int64Ty}, false);
+    auto* helper   = "CaLlCoUnTeR_called";
+    auto* add      = "CaLlCoUnTeR_add";
+    if (CounterMode::ATOMIC == options.mode) {
+      helper = "CaLlCoUnTeR_calledAtomic";
+      add    = "CaLlCoUnTeR_addAtomic";
+    } else if (CounterMode::THREAD_LOCAL == options.mode) {
+      helper = "CaLlCoUnTeR_calledLocal";
+      add    = "CaLlCoUnTeR_addLocal";
+    }
+    counter = m.getOrInsertFunction(helper, helperTy);
+    if (options.coalesce || options.promoteLoops) {
+      adder = m.getOrInsertFunction(add, adderTy);
+    }
+  }
+
+  // Per thread counter blocks are found through a thread local pointer of the
+  // module. Threads register a new block with the runtime on first use, which
+  // sets the pointer.
+  if (CounterMode::THREAD_LOCAL == options.mode) {
+    registerThread = m.getOrInsertFunction(
+        "CaLlCoUnTeR_registerThread",
+        FunctionType::get(ptrTy, {ptrTy, ptrTy}, false));
+    localCounters  = new GlobalVariable(m,
+                                       ptrTy,
+                                       false,
+                                       GlobalValue::InternalLinkage,
+                                       ConstantPointerNull::get(ptrTy),
+                                       "CaLlCoUnTeR_localCounters",
+                                       nullptr,
+                                       GlobalValue::GeneralDynamicTLSModel);
+  }
+
+  if (SamplingMode::NONE != options.sampling) {
+    declareSampling(m);
+  }
+
+  indirectCall = nullptr;
+  if (options.profileIndirect) {
+    indirectCall = m.getOrInsertFunction(
+        "CaLlCoUnTeR_indirectCall",
+        FunctionType::get(voidTy, {ptrTy, int64Ty, ptrTy}, false));
+  }
+  indirectSites.clear();
+  indirectTargets  = nullptr;
+  indirectSiteInfo = nullptr;
+  functionAddrs    = nullptr;
+
+  if (options.timing) {
+    timeEnter  = m.getOrInsertFunction(
+        "CaLlCoUnTeR_timeEnter", FunctionType::get(int64Ty, {ptrTy, int64Ty}, false));
+    timeExit   = m.getOrInsertFunction(
+        "CaLlCoUnTeR_timeExit", FunctionType::get(voidTy, {int64Ty}, false));
+    timeUnwind = m.getOrInsertFunction(
+        "CaLlCoUnTeR_timeUnwind", FunctionType::get(voidTy, {int64Ty}, false));
+  }
 
   for (auto f : toCount) {
     // We only want to instrument internally defined functions.
@@ -132,46 +228,854 @@ DynamicCallCounter::run(Module& m, ModuleAnalysisManager& mam) {
       continue;
     }
 
-    // Count each internal function as it executes.
-    handleCalledFunction(*f, counter);
-
-    // Count each external function as it is called.
+    // Collect the calls up front because instrumentation may split blocks.
+    std::vector<CallBase*> calls;
     for (auto& bb : *f) {
       for (auto& i : bb) {
         if (CallBase* cb = dyn_cast<CallBase>(&i)) {
-          handleInstruction(*cb, counter);
+          calls.push_back(cb);
         }
       }
     }
+
+    // Count each internal function as it executes.
+    handleCalledFunction(*f);
+
+    // Count each external function as it is called.
+    sites.clear();
+    for (auto* cb : calls) {
+      handleInstruction(*cb);
+    }
+    placeUpdates(*f);
+
+    if (options.timing) {
+      addTimingHooks(*f, calls);
+    }
+  }
+
+  for (auto& [f, calls] : splitCalls) {
+    splitEntry(*f, calls);
   }
 
+  if (options.profileIndirect) {
+    createIndirectTables(m);
+  }
+  registerModule(m);
+
   return PreservedAnalyses::none();
 }
 
 
 void
-DynamicCallCounter::handleCalledFunction(Function& f, FunctionCallee counter) {
-  IRBuilder<> builder(&*f.getEntryBlock().getFirstInsertionPt());
-  builder.CreateCall(counter, builder.getInt64(ids[&f]));
+DynamicCallCounter::handleCalledFunction(Function& f) {
+  // Leave the static allocas at the top of the entry block in case it must be
+  // split for finding the counters of the current thread.
+  auto* insertionPt = &*f.getEntryBlock().getFirstInsertionPt();
+  while (isa<AllocaInst>(insertionPt)) {
+    insertionPt = insertionPt->getNextNode();
+  }
+
+  // The entry block dominates the entire function, so the counter block of
+  // the thread only needs to be found once per invocation.
+  localBlock = nullptr;
+  if (CounterMode::THREAD_LOCAL == options.mode
+      && CounterUpdate::INLINE == options.update) {
+    localBlock = loadLocalBlock(*insertionPt);
+  }
+
+  if (isCountedOnEntry(f)) {
+    IRBuilder<> builder(insertionPt);
+    emitIncrement(builder, ids[&f]);
+  }
+}
+
+
+// Whether a function can be entered other than by direct calls from
+// instrumented functions within the module.
+bool
+DynamicCallCounter::isEnteredElsewhere(Function& f) const {
+  return !f.hasLocalLinkage() || f.hasAddressTaken()
+         || llvm::any_of(f.users(), [this](User* user) {
+              auto* cb = dyn_cast<CallBase>(user);
+              return !cb || !ids.count(cb->getFunction());
+            });
+}
+
+
+// When counting edges, each call costs a single update. Functions that can
+// only be reached by direct calls from instrumented functions are counted by
+// their incoming edges alone. Functions that may also be entered from
+// elsewhere are split when direct calls count their edges, and only count the
+// other entries in the part that keeps their name. The runtime adds their
+// edges to these counts.
+bool
+DynamicCallCounter::isCountedOnEntry(Function& f) const {
+  return !options.countEdges
+         || (enteredElsewhere.count(&f) && !splitCalls.count(&f));
+}
+
+
+// Returns the callee whose edge counter a direct call updates, or null when
+// the call is not counted by its edge. Calls to functions that may also be
+// entered from elsewhere must be able to call the split body directly.
+// Otherwise, these functions are only counted on entry.
+Function*
+DynamicCallCounter::getEdgeCallee(CallBase& cb) const {
+  auto* called = dyn_cast<Function>(cb.getCalledOperand()->stripPointerCasts());
+  if (!called || !ids.count(called)) {
+    return nullptr;
+  }
+  if (called->isDeclaration() || !enteredElsewhere.count(called)) {
+    return called;
+  }
+  bool direct = cb.getCalledOperand() == called
+                && cb.getFunctionType() == called->getFunctionType();
+  return direct && canSplitEntry(*called) ? called : nullptr;
+}
+
+
+// Moves the instrumented body of `f` into an internal function that the
+// direct calls counted by their edges call instead. `f` keeps its name and
+// address, counts its remaining entries, and forwards them with a tail call.
+void
+DynamicCallCounter::splitEntry(Function& f, ArrayRef<CallBase*> calls) {
+  auto& context = f.getContext();
+  auto* body    = Function::Create(f.getFunctionType(),
+                                GlobalValue::InternalLinkage,
+                                f.getAddressSpace(),
+                                f.getName() + ".callcounter.body",
+                                f.getParent());
+  body->copyAttributesFrom(&f);
+  body->setLinkage(GlobalValue::InternalLinkage);
+  body->setVisibility(GlobalValue::DefaultVisibility);
+  body->setDLLStorageClass(GlobalValue::DefaultStorageClass);
+  body->setSubprogram(f.getSubprogram());
+  f.setSubprogram(nullptr);
+
+  body->splice(body->end(), &f);
+  for (auto [from, to] : llvm::zip(f.args(), body->args())) {
+    from.replaceAllUsesWith(&to);
+    to.takeName(&from);
+  }
+
+  // Forwarding must preserve every attribute that affects the ABI.
+  auto attributes = f.getAttributes();
+  SmallVector<AttributeSet, 8> params;
+  for (unsigned i = 0; i < f.arg_size(); ++i) {
+    params.push_back(attributes.getParamAttrs(i));
+  }
+  IRBuilder<> builder(BasicBlock::Create(context, "entry", &f));
+  SmallVector<Value*, 8> args;
+  for (auto& arg : f.args()) {
+    args.push_back(&arg);
+  }
+  auto* forward = builder.CreateCall(body, args);
+  forward->setTailCallKind(CallInst::TCK_MustTail);
+  forward->setCallingConv(f.getCallingConv());
+  forward->setAttributes(
+      AttributeList::get(context, AttributeSet{}, attributes.getRetAttrs(), params));
+  if (f.getReturnType()->isVoidTy()) {
+    builder.CreateRetVoid();
+  } else {
+    builder.CreateRet(forward);
+  }
+
+  localBlock = nullptr;
+  if (CounterMode::THREAD_LOCAL == options.mode
+      && CounterUpdate::INLINE == options.update) {
+    localBlock = loadLocalBlock(*forward);
+  }
+  builder.SetInsertPoint(forward);
+  emitIncrement(builder, ids[&f]);
+
+  for (auto* cb : calls) {
+    cb->setCalledOperand(body);
+  }
+}
+
+
+// Intrinsics are never counted, since calls to them are not real calls and
+// instrumenting them would inhibit optimizations. Other functions are counted
+// unless the name or profile filters rule them out.
+bool
+DynamicCallCounter::isSelected(Function& f) const {
+  if (f.isIntrinsic()) {
+    return false;
+  }
+
+  auto name    = f.getName();
+  auto matches = [name](auto& pattern) { return pattern.match(name); };
+  if ((!options.allow.empty() && llvm::none_of(options.allow, matches))
+      || llvm::any_of(options.deny, matches)) {
+    return false;
+  }
+
+  if (!f.isDeclaration() && f.getInstructionCount() < options.minInstructions) {
+    return false;
+  }
+  return !options.maxCalls
+         || options.profileCounts.lookup(name) <= options.maxCalls;
+}
+
+
+// Returns the functions to count in module order. Selected functions that are
+// defined here are counted on entry, while declarations are only counted when
+// some instrumented function calls them, so that unused declarations take no
+// counters.
+std::vector<Function*>
+DynamicCallCounter::selectFunctions(Module& m) const {
+  DenseSet<Function*> selected;
+  DenseSet<Function*> called;
+  for (auto& f : m) {
+    if (f.isDeclaration() || !isSelected(f)) {
+      continue;
+    }
+    selected.insert(&f);
+    for (auto& bb : f) {
+      for (auto& i : bb) {
+        auto* cb = dyn_cast<CallBase>(&i);
+        if (!cb) {
+          continue;
+        }
+        auto* callee = dyn_cast<Function>(cb->getCalledOperand()->stripPointerCasts());
+        if (callee && callee->isDeclaration()) {
+          called.insert(callee);
+        }
+      }
+    }
+  }
+
+  std::vector<Function*> functions;
+  for (auto& f : m) {
+    if (selected.count(&f) || (called.count(&f) && isSelected(f))) {
+      functions.push_back(&f);
+    }
+  }
+  return functions;
 }
 
 
 void
-DynamicCallCounter::handleInstruction(CallBase& cb, FunctionCallee counter) {
+DynamicCallCounter::handleInstruction(CallBase& cb) {
   // Check whether the called function is directly invoked
   auto called = dyn_cast<Function>(cb.getCalledOperand()->stripPointerCasts());
   if (!called) {
+    if (options.profileIndirect && !cb.isInlineAsm()) {
+      handleIndirectCall(cb);
+    }
+    return;
+  }
+
+  // Each direct call counted by its edge updates only the counter of its edge.
+  if (options.countEdges && getEdgeCallee(cb)) {
+    sites.push_back({&cb, edgeIDs.lookup({cb.getFunction(), called})});
+    if (auto found = splitCalls.find(called); found != splitCalls.end()) {
+      found->second.push_back(&cb);
+    }
     return;
   }
 
   // Check if the function is internal or blacklisted.
   if (internal.count(called) || !ids.count(called)) {
     // Internal functions are counted upon the entry of each function body.
-    // Blacklisted functions are not counted. Neither should proceed.
+    // Functions that were not selected are not counted. Neither should
+    // proceed.
     return;
   }
 
   // External functions are counted at their invocation sites.
+  sites.push_back({&cb, ids[called]});
+}
+
+
+// Passes the target of an indirect call to the runtime, which records the
+// distribution of targets for each call site.
+void
+DynamicCallCounter::handleIndirectCall(CallBase& cb) {
+  auto& loc   = cb.getDebugLoc();
+  auto caller = ids[cb.getFunction()];
+  indirectSites.emplace_back(caller, loc ? loc.getLine() : 0);
+
   IRBuilder<> builder(&cb);
-  builder.CreateCall(counter, builder.getInt64(ids[called]));
+  builder.CreateCall(indirectCall,
+                     {moduleInfo,
+                      builder.getInt64(indirectSites.size() - 1),
+                      cb.getCalledOperand()});
+}
+
+
+// Times each call of a defined function, and each call from it to a counted
+// external function, on a shadow stack kept by the runtime for every thread.
+// Entering returns the level of the new frame, and each way out of the
+// function closes the frames down to that level. Returns and resumed
+// exceptions close the function's own frame. Landing pads close the frames of
+// the callees that an exception unwound through. Frames skipped by longjmp
+// are closed by the next hook of a caller, and frames still open when a
+// thread exits are closed then.
+void
+DynamicCallCounter::addTimingHooks(Function& f, ArrayRef<CallBase*> calls) {
+  // Calls to external functions are timed around the call. Invokes are left
+  // to the caller's own time, since their normal destinations may be shared.
+  for (auto* cb : calls) {
+    auto* call   = dyn_cast<CallInst>(cb);
+    auto* called = dyn_cast<Function>(cb->getCalledOperand()->stripPointerCasts());
+    if (!call || call->isMustTailCall() || !called || !called->isDeclaration()
+        || !ids.count(called)) {
+      continue;
+    }
+    IRBuilder<> builder(call);
+    auto* level = builder.CreateCall(timeEnter,
+                                     {moduleInfo, builder.getInt64(ids[called])});
+    builder.SetInsertPoint(call->getNextNode());
+    builder.CreateCall(timeExit, level);
+  }
+
+  auto* insertionPt = &*f.getEntryBlock().getFirstInsertionPt();
+  while (isa<AllocaInst>(insertionPt)) {
+    insertionPt = insertionPt->getNextNode();
+  }
+  IRBuilder<> builder(insertionPt);
+  auto* level = builder.CreateCall(timeEnter, {moduleInfo, builder.getInt64(ids[&f])});
+
+  for (auto& bb : f) {
+    auto* term = bb.getTerminator();
+    if (isa<ReturnInst>(term)) {
+      // Nothing may come between a musttail call and the return, so the frame
+      // is closed before the call instead.
+      auto* tail = bb.getTerminatingMustTailCall();
+      IRBuilder<>(tail ? tail : term).CreateCall(timeExit, level);
+    } else if (isa<ResumeInst>(term)) {
+      IRBuilder<>(term).CreateCall(timeExit, level);
+    }
+    if (bb.isLandingPad()) {
+      IRBuilder<>(&*bb.getFirstInsertionPt()).CreateCall(timeUnwind, level);
+    }
+  }
+}
+
+
+// Creates the counter tables of the module:
+// - the zero initialized counts, aligned to cache lines
+// - the NUL terminated names of the counters in one blob
+// - the offset of the name of each counter in the blob
+// - the callcounter::profile::CounterKind of each counter
+// Keeping the names apart leaves whole cache lines to the counters, and the
+// offsets need no relocations in position independent code. Continuous
+// profiles map whole pages over the counters, so no other data may share them.
+void
+DynamicCallCounter::createCounterTables(Module& m,
+                                        ArrayRef<std::string> names,
+                                        ArrayRef<uint8_t> kinds) {
+  auto& context = m.getContext();
+  auto* int64Ty = Type::getInt64Ty(context);
+
+  // Identical names share their place in the blob.
+  std::string blob;
+  StringMap<uint32_t> blobOffsets;
+  std::vector<uint32_t> offsets;
+  for (auto& name : names) {
+    auto [offset, inserted] = blobOffsets.try_emplace(name, blob.size());
+    if (inserted) {
+      blob += name;
+      blob.push_back('\0');
+    }
+    offsets.push_back(offset->second);
+  }
+
+  auto alignment   = options.continuous ? profile::CONTINUOUS_ALIGNMENT : 64;
+  auto numCounters = alignTo(names.size(), alignment / sizeof(uint64_t));
+  auto* countersTy = ArrayType::get(int64Ty, numCounters);
+  counterArray     = new GlobalVariable(m,
+                                    countersTy,
+                                    false,
+                                    GlobalValue::InternalLinkage,
+                                    ConstantAggregateZero::get(countersTy),
+                                    "CaLlCoUnTeR_counters");
+  counterArray->setAlignment(Align(alignment));
+
+  auto* blobData = ConstantDataArray::getString(context, blob, false);
+  counterNames   = new GlobalVariable(m,
+                                    blobData->getType(),
+                                    true,
+                                    GlobalValue::PrivateLinkage,
+                                    blobData,
+                                    "CaLlCoUnTeR_names");
+  auto* offsetData = ConstantDataArray::get(context, offsets);
+  nameOffsets      = new GlobalVariable(m,
+                                   offsetData->getType(),
+                                   true,
+                                   GlobalValue::PrivateLinkage,
+                                   offsetData,
+                                   "CaLlCoUnTeR_nameOffsets");
+  auto* kindData = ConstantDataArray::get(context, kinds);
+  counterKinds   = new GlobalVariable(m,
+                                    kindData->getType(),
+                                    true,
+                                    GlobalValue::PrivateLinkage,
+                                    kindData,
+                                    "CaLlCoUnTeR_kinds");
+}
+
+
+// Creates the tables the runtime uses to record and report indirect targets:
+// - the zero initialized target counts per site
+// - the caller ID and line of each site
+// - the address of each function ID where available, for mapping the targets
+//   back to names
+void
+DynamicCallCounter::createIndirectTables(Module& m) {
+  auto& context  = m.getContext();
+  auto* int64Ty  = Type::getInt64Ty(context);
+  auto* ptrTy    = PointerType::get(context, 0);
+  auto numSites  = indirectSites.size();
+
+  // Each site holds the targets, their counts, and an overflow count.
+  auto* siteTy    = ArrayType::get(int64Ty, 2 * profile::INDIRECT_TARGETS + 1);
+  auto* targetsTy = ArrayType::get(siteTy, numSites);
+  indirectTargets = new GlobalVariable(m,
+                                       targetsTy,
+                                       false,
+                                       GlobalValue::InternalLinkage,
+                                       ConstantAggregateZero::get(targetsTy),
+                                       "CaLlCoUnTeR_indirectTargets");
+
+  auto* infoTy = StructType::get(context, {int64Ty, int64Ty});
+  std::vector<Constant*> infos;
+  for (auto [caller, line] : indirectSites) {
+    infos.push_back(ConstantStruct::get(
+        infoTy, {ConstantInt::get(int64Ty, caller), ConstantInt::get(int64Ty, line)}));
+  }
+  auto* infoTableTy = ArrayType::get(infoTy, numSites);
+  indirectSiteInfo  = new GlobalVariable(m,
+                                        infoTableTy,
+                                        true,
+                                        GlobalValue::PrivateLinkage,
+                                        ConstantArray::get(infoTableTy, infos),
+                                        "CaLlCoUnTeR_indirectSiteInfo");
+
+  // Only functions that are defined here or whose addresses are taken anyway
+  // can be referenced without adding link dependencies.
+  auto numCounters = ids.size() + edgeIDs.size();
+  std::vector<Constant*> addresses(numCounters, ConstantPointerNull::get(ptrTy));
+  for (auto [f, id] : ids) {
+    if (!f->isIntrinsic() && (!f->isDeclaration() || f->hasAddressTaken())) {
+      addresses[id] = f;
+    }
+  }
+  auto* addressesTy = ArrayType::get(ptrTy, addresses.size());
+  functionAddrs     = new GlobalVariable(m,
+                                     addressesTy,
+                                     true,
+                                     GlobalValue::PrivateLinkage,
+                                     ConstantArray::get(addressesTy, addresses),
+                                     "CaLlCoUnTeR_functionAddrs");
+}
+
+
+// Creates the edges into every callee, so that the runtime can total their
+// calls from the edges. The counter of a callee only holds its other entries.
+void
+DynamicCallCounter::createEdgeTable(Module& m) {
+  auto& context = m.getContext();
+  auto* int64Ty = Type::getInt64Ty(context);
+  auto* edgeTy  = StructType::get(context, {int64Ty, int64Ty});
+
+  std::vector<Constant*> edges;
+  for (auto& [edge, id] : edgeIDs) {
+    edges.push_back(ConstantStruct::get(
+        edgeTy,
+        {ConstantInt::get(int64Ty, ids[edge.second]), ConstantInt::get(int64Ty, id)}));
+  }
+
+  auto* edgesTy = ArrayType::get(edgeTy, edges.size());
+  derivedEdges  = new GlobalVariable(m,
+                                    edgesTy,
+                                    true,
+                                    GlobalValue::PrivateLinkage,
+                                    ConstantArray::get(edgesTy, edges),
+                                    "CaLlCoUnTeR_derivedEdges");
+}
+
+
+// Fills in the descriptor of the module and registers it with the runtime
+// before the program runs. The layout matches ModuleInfo in the runtime:
+//   { numCounters, counters, names, nameOffsets, kinds,
+//     numDerivedEdges, derivedEdges,
+//     numIndirectSites, indirectTargets, indirectSiteInfo, functionAddrs,
+//     flags }
+// Modules unregister when they are unloaded, so the runtime can keep their
+// counts after their tables are gone.
+void
+DynamicCallCounter::registerModule(Module& m) {
+  auto& context = m.getContext();
+  auto* voidTy  = Type::getVoidTy(context);
+  auto* int64Ty = Type::getInt64Ty(context);
+  auto* ptrTy   = PointerType::get(context, 0);
+
+  auto getSize = [int64Ty](GlobalVariable* table) -> Constant* {
+    return ConstantInt::get(
+        int64Ty, table ? table->getValueType()->getArrayNumElements() : 0);
+  };
+  auto getTable = [ptrTy](GlobalVariable* table) -> Constant* {
+    return table ? static_cast<Constant*>(table) : ConstantPointerNull::get(ptrTy);
+  };
+
+  auto numCounters = ids.size() + edgeIDs.size();
+  uint64_t flags   = 0;
+  if (options.continuous) {
+    flags |= profile::MODULE_CONTINUOUS;
+  }
+  if (options.timing) {
+    flags |= profile::MODULE_TIMING;
+  }
+  if (options.timing && options.latencyHistograms) {
+    flags |= profile::MODULE_HISTOGRAMS;
+  }
+  if (SamplingMode::NONE != options.sampling) {
+    flags |= profile::MODULE_SAMPLED;
+  }
+  moduleInfo->setInitializer(ConstantStruct::get(
+      cast<StructType>(moduleInfo->getValueType()),
+      {ConstantInt::get(int64Ty, numCounters),
+       counterArray,
+       counterNames,
+       nameOffsets,
+       counterKinds,
+       getSize(derivedEdges),
+       getTable(derivedEdges),
+       getSize(indirectTargets),
+       getTable(indirectTargets),
+       getTable(indirectSiteInfo),
+       getTable(functionAddrs),
+       ConstantInt::get(int64Ty, flags)}));
+
+  auto* hookTy = FunctionType::get(voidTy, ptrTy, false);
+  auto addHook = [&](const char* name, const char* runtimeName) {
+    auto* hook = Function::Create(FunctionType::get(voidTy, false),
+                                  GlobalValue::InternalLinkage,
+                                  name,
+                                  m);
+    IRBuilder<> builder(BasicBlock::Create(context, "entry", hook));
+    builder.CreateCall(m.getOrInsertFunction(runtimeName, hookTy), moduleInfo);
+    builder.CreateRetVoid();
+    return hook;
+  };
+  appendToGlobalCtors(
+      m, addHook("CaLlCoUnTeR_registerModule", "CaLlCoUnTeR_register"), 0);
+  appendToGlobalDtors(
+      m, addHook("CaLlCoUnTeR_unregisterModule", "CaLlCoUnTeR_unregister"), 0);
+}
+
+
+// Declares the sampling state of the runtime and starts sampling before the
+// program runs.
+void
+DynamicCallCounter::declareSampling(Module& m) {
+  auto& context = m.getContext();
+  auto* voidTy  = Type::getVoidTy(context);
+  auto* int32Ty = Type::getInt32Ty(context);
+  auto* int64Ty = Type::getInt64Ty(context);
+  auto* ptrTy   = PointerType::get(context, 0);
+
+  if (SamplingMode::COUNTDOWN == options.sampling) {
+    sampleCountdown = new GlobalVariable(m,
+                                         int64Ty,
+                                         false,
+                                         GlobalValue::ExternalLinkage,
+                                         nullptr,
+                                         "CaLlCoUnTeR_sampleCountdown",
+                                         nullptr,
+                                         GlobalValue::GeneralDynamicTLSModel);
+    sampleHit = m.getOrInsertFunction(
+        "CaLlCoUnTeR_sampleHit",
+        FunctionType::get(voidTy, {ptrTy, int64Ty, int64Ty}, false));
+  } else {
+    sampleEnabled = new GlobalVariable(m,
+                                       Type::getInt8Ty(context),
+                                       false,
+                                       GlobalValue::ExternalLinkage,
+                                       nullptr,
+                                       "CaLlCoUnTeR_sampleEnabled");
+  }
+
+  auto start = m.getOrInsertFunction(
+      "CaLlCoUnTeR_startSampling",
+      FunctionType::get(voidTy, {int32Ty, int64Ty}, false));
+  auto* init = Function::Create(FunctionType::get(voidTy, false),
+                                GlobalValue::InternalLinkage,
+                                "CaLlCoUnTeR_initSampling",
+                                m);
+  IRBuilder<> builder(BasicBlock::Create(context, "entry", init));
+  builder.CreateCall(start,
+                     {builder.getInt32(static_cast<uint32_t>(options.sampling)),
+                      builder.getInt64(options.samplePeriod)});
+  builder.CreateRetVoid();
+  appendToGlobalCtors(m, init, 0);
+}
+
+
+// Calls that may unwind or never return can leave a block midway, so the
+// sites after them might not be reached.
+static bool
+mayLeaveEarly(const Instruction& i) {
+  auto* cb = dyn_cast<CallBase>(&i);
+  return cb && (cb->mayThrow() || cb->doesNotReturn());
+}
+
+
+// Loops can only be promoted when the counts can be flushed to memory on
+// every path out of them. Leaving a loop by unwinding, exiting the program or
+// thread, or jumping out of it would skip the flush.
+static bool
+canPromote(const Loop& loop) {
+  SmallVector<BasicBlock*, 8> exits;
+  loop.getUniqueExitBlocks(exits);
+  return loop.getLoopPreheader() && loop.hasDedicatedExits() && !exits.empty()
+         && llvm::all_of(exits,
+                         [](auto* exit) {
+                           return exit->getFirstInsertionPt() != exit->end();
+                         })
+         && llvm::none_of(loop.blocks(), [](auto* bb) {
+              return llvm::any_of(*bb, mayLeaveEarly);
+            });
+}
+
+
+// Inserts the pending call site updates of a function. Without coalescing or
+// promotion, every site is counted individually. Otherwise, the sites for one
+// counter within a run of a block that is not interrupted by a call that may
+// leave early share a single add of their total before the first of them, and
+// those within promotable loops are further accumulated in a register that is
+// flushed when leaving the loop. Loops with calls that may leave early are
+// not promoted, so that their counts are not lost.
+void
+DynamicCallCounter::placeUpdates(Function& f) {
+  std::unique_ptr<DominatorTree> dt;
+  std::unique_ptr<LoopInfo> li;
+  if (options.promoteLoops) {
+    dt = std::make_unique<DominatorTree>(f);
+    li = std::make_unique<LoopInfo>(*dt);
+  }
+  auto getPromotableLoop = [&li](BasicBlock* bb) -> Loop* {
+    auto* loop = li ? li->getLoopFor(bb) : nullptr;
+    return loop && canPromote(*loop) ? loop : nullptr;
+  };
+
+  // Each run of a block starts after the last call before it that may leave
+  // early, or at the start of the block.
+  DenseMap<Instruction*, Instruction*> runStarts;
+  DenseSet<BasicBlock*> scanned;
+  auto getRunStart = [&runStarts, &scanned](Instruction* before) {
+    auto* bb = before->getParent();
+    if (scanned.insert(bb).second) {
+      Instruction* start = nullptr;
+      for (auto& i : *bb) {
+        runStarts[&i] = start;
+        if (mayLeaveEarly(i)) {
+          start = &i;
+        }
+      }
+    }
+    return runStarts.lookup(before);
+  };
+
+  // Updates may split blocks when sampling, so they are only emitted once the
+  // loop structure is no longer needed.
+  std::vector<CounterSite> updates;
+  MapVector<std::tuple<BasicBlock*, Instruction*, uint64_t>,
+            std::pair<CounterSite, uint64_t>>
+      blockSites;
+  for (auto& site : sites) {
+    auto* bb = site.before->getParent();
+    if (!options.coalesce && !getPromotableLoop(bb)) {
+      updates.push_back(site);
+      continue;
+    }
+    auto key    = std::make_tuple(bb, getRunStart(site.before), site.id);
+    auto& group = blockSites.insert({key, {site, 0}}).first->second;
+    ++group.second;
+  }
+
+  auto* int64Ty = Type::getInt64Ty(f.getContext());
+  MapVector<std::pair<Loop*, uint64_t>,
+            std::pair<SmallVector<CounterSite, 4>, SmallVector<uint64_t, 4>>>
+      loopSites;
+  for (auto& [key, group] : blockSites) {
+    auto& [site, amount] = group;
+    if (auto* loop = getPromotableLoop(std::get<0>(key))) {
+      auto& promoted = loopSites[{loop, site.id}];
+      promoted.first.push_back(site);
+      promoted.second.push_back(amount);
+      continue;
+    }
+    updates.push_back({site.before, site.id, ConstantInt::get(int64Ty, amount)});
+  }
+
+  for (auto& [key, promoted] : loopSites) {
+    promoteCounter(
+        *key.first, key.second, promoted.first, promoted.second, updates);
+  }
+
+  for (auto& update : updates) {
+    IRBuilder<> builder(update.before);
+    auto* amount = update.amount ? update.amount : builder.getInt64(1);
+    emitIncrement(builder, update.id, amount);
+  }
+}
+
+
+// Keeps the count for `id` within `loop` in SSA form, starting from 0 in the
+// preheader, and adds the accumulated value to the counter on each exit.
+void
+DynamicCallCounter::promoteCounter(Loop& loop,
+                                   uint64_t id,
+                                   ArrayRef<CounterSite> blockSites,
+                                   ArrayRef<uint64_t> amounts,
+                                   std::vector<CounterSite>& updates) {
+  auto* int64Ty = Type::getInt64Ty(loop.getHeader()->getContext());
+
+  SSAUpdater ssa;
+  ssa.Initialize(int64Ty, "callcounter.promoted");
+  ssa.AddAvailableValue(loop.getLoopPreheader(), ConstantInt::get(int64Ty, 0));
+
+  // Each block adds its amount to the value flowing into it. The incoming
+  // values can only be resolved once all blocks have been defined.
+  SmallVector<Instruction*, 4> adds;
+  for (auto [site, amount] : llvm::zip(blockSites, amounts)) {
+    IRBuilder<> builder(site.before);
+    auto* add = builder.Insert(BinaryOperator::CreateAdd(
+        PoisonValue::get(int64Ty), builder.getInt64(amount)));
+    ssa.AddAvailableValue(add->getParent(), add);
+    adds.push_back(add);
+  }
+  for (auto* add : adds) {
+    add->setOperand(0, ssa.GetValueInMiddleOfBlock(add->getParent()));
+  }
+
+  SmallVector<BasicBlock*, 8> exits;
+  loop.getUniqueExitBlocks(exits);
+  for (auto* exit : exits) {
+    updates.push_back({&*exit->getFirstInsertionPt(),
+                       id,
+                       ssa.GetValueInMiddleOfBlock(exit)});
+  }
+}
+
+
+// Loads the counter block of the current thread before the given instruction,
+// registering a new block with the runtime if the thread does not have one.
+Value*
+DynamicCallCounter::loadLocalBlock(Instruction& before) {
+  auto& context = before.getContext();
+  auto* blockTy = PointerType::get(context, 0);
+
+  IRBuilder<> builder(&before);
+  auto* block   = builder.CreateAlignedLoad(blockTy, localCounters, Align(8));
+  auto* isNew   = builder.CreateIsNull(block);
+  auto* weights = MDBuilder(context).createBranchWeights(1, 1 << 20);
+  auto* oldBB   = before.getParent();
+  auto* term    = SplitBlockAndInsertIfThen(isNew, &before, false, weights);
+
+  builder.SetInsertPoint(term);
+  auto* registered = builder.CreateCall(registerThread, {moduleInfo, localCounters});
+
+  builder.SetInsertPoint(&before);
+  auto* phi = builder.CreatePHI(blockTy, 2);
+  phi->addIncoming(block, oldBB);
+  phi->addIncoming(registered, term->getParent());
+  return phi;
+}
+
+
+void
+DynamicCallCounter::emitIncrement(IRBuilder<>& builder, uint64_t id) {
+  emitIncrement(builder, id, builder.getInt64(1));
+}
+
+
+// Counts `amount` events for `id`, subject to sampling. The insertion point of
+// the builder is kept before the same instruction even if the block is split.
+void
+DynamicCallCounter::emitIncrement(IRBuilder<>& builder,
+                                  uint64_t id,
+                                  Value* amount) {
+  if (SamplingMode::NONE == options.sampling) {
+    emitUpdate(builder, id, amount);
+    return;
+  }
+
+  auto& context = builder.getContext();
+  auto* before  = &*builder.GetInsertPoint();
+  auto* int64Ty = builder.getInt64Ty();
+  auto* rarely  = MDBuilder(context).createBranchWeights(1, 1 << 20);
+
+  if (SamplingMode::COUNTDOWN == options.sampling) {
+    // Only when the countdown of the thread expires does the runtime record
+    // the sample and restart the countdown.
+    auto* countdown = builder.CreateAlignedLoad(int64Ty, sampleCountdown, Align(8));
+    auto* remaining = builder.CreateSub(countdown, amount);
+    builder.CreateAlignedStore(remaining, sampleCountdown, Align(8));
+    auto* expired = builder.CreateICmpSLE(remaining, builder.getInt64(0));
+    auto* term    = SplitBlockAndInsertIfThen(expired, before, false, rarely);
+    IRBuilder<> sampler(term);
+    sampler.CreateCall(sampleHit,
+                       {moduleInfo,
+                        sampler.getInt64(id),
+                        sampler.getInt64(options.samplePeriod)});
+  } else {
+    // Update the counters only while the runtime has a window open.
+    auto* enabled = builder.CreateAlignedLoad(
+        builder.getInt8Ty(), sampleEnabled, Align(1));
+    enabled->setAtomic(AtomicOrdering::Monotonic);
+    auto* isOpen = builder.CreateIsNotNull(enabled);
+    auto* term   = SplitBlockAndInsertIfThen(isOpen, before, false);
+    IRBuilder<> sampler(term);
+    emitUpdate(sampler, id, amount);
+  }
+
+  builder.SetInsertPoint(before);
+}
+
+
+void
+DynamicCallCounter::emitUpdate(IRBuilder<>& builder,
+                               uint64_t id,
+                               Value* amount) {
+  if (CounterUpdate::CALL == options.update) {
+    auto* one = dyn_cast<ConstantInt>(amount);
+    if (one && one->isOne()) {
+      builder.CreateCall(counter, {moduleInfo, builder.getInt64(id)});
+    } else {
+      builder.CreateCall(adder, {moduleInfo, builder.getInt64(id), amount});
+    }
+    return;
+  }
+
+  auto* int64Ty = builder.getInt64Ty();
+
+  if (CounterMode::THREAD_LOCAL == options.mode) {
+    // Only this thread writes to its block, so a relaxed load and store
+    // suffice. They keep the runtime's concurrent reads free of data races.
+    auto* slot  = builder.CreateConstInBoundsGEP1_64(int64Ty, localBlock, id);
+    auto* count = builder.CreateAlignedLoad(int64Ty, slot, Align(8));
+    count->setAtomic(AtomicOrdering::Monotonic);
+    auto* store = builder.CreateAlignedStore(
+        builder.CreateAdd(count, amount), slot, Align(8));
+    store->setAtomic(AtomicOrdering::Monotonic);
+    return;
+  }
+
+  // Update the counter of the module in place. This avoids the call into the
+  // runtime along with the register spills it forces.
+  auto* slot = builder.CreateConstInBoundsGEP2_64(
+      counterArray->getValueType(), counterArray, 0, id);
+
+  if (CounterMode::ATOMIC == options.mode) {
+    builder.CreateAtomicRMW(
+        AtomicRMWInst::Add, slot, amount, Align(8), AtomicOrdering::Monotonic);
+    return;
+  }
+
+  auto* count = builder.CreateAlignedLoad(int64Ty, slot, Align(8));
+  builder.CreateAlignedStore(builder.CreateAdd(count, amount), slot, Align(8));
 }
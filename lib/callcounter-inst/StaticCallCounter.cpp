@@ -2,6 +2,7 @@
 
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/Support/Parallel.h"
 
 #include "StaticCallCounter.h"
 
@@ -18,9 +19,70 @@ AnalysisKey StaticCallCounter::Key;
 }
 
 
+// Each thread takes several contiguous ranges of functions to balance the
+// load when function sizes vary widely.
+static constexpr size_t TASKS_PER_THREAD = 4;
+
+
 void
 StaticCallCounts::analyze(const Module& m) {
+  std::vector<const Function*> functions;
+  for (auto& f : m) {
+    if (!f.isDeclaration()) {
+      functions.push_back(&f);
+    }
+  }
+  analyze(functions);
+}
+
+
+// Counts contiguous ranges of functions into separate maps and merges them in
+// order, so the result matches a sequential walk for any number of threads.
+void
+StaticCallCounts::analyze(ArrayRef<const Function*> functions) {
+  size_t numTasks = std::min(
+      functions.size(),
+      parallel::strategy.compute_thread_count() * TASKS_PER_THREAD);
+  if (numTasks == 0) {
+    return;
+  }
+
+  std::vector<StaticCallCounts> partials(numTasks);
+  parallelFor(0, numTasks, [&](size_t task) {
+    auto begin = functions.size() * task / numTasks;
+    auto end   = functions.size() * (task + 1) / numTasks;
+    for (auto* f : functions.slice(begin, end - begin)) {
+      for (auto& bb : *f) {
+        for (auto& i : bb) {
+          if (const auto* cb = dyn_cast<const CallBase>(&i)) {
+            partials[task].handleInstruction(*cb);
+          }
+        }
+      }
+    }
+  });
+
+  for (auto& partial : partials) {
+    for (auto& [function, count] : partial.counts) {
+      counts[function] += count;
+    }
+  }
+}
+
+
+// Bodies are counted in module order, so the result matches analyze(). Deleting
+// each body drops its instructions and references once it has been counted,
+// so peak memory follows the largest function rather than the whole module.
+Error
+StaticCallCounts::analyzeLazily(Module& m) {
   for (auto& f : m) {
+    if (f.isDeclaration()) {
+      continue;
+    }
+    if (auto error = f.materialize()) {
+      return error;
+    }
+
     for (auto& bb : f) {
       for (auto& i : bb) {
         if (const auto* cb = dyn_cast<const CallBase>(&i)) {
@@ -28,7 +90,10 @@ StaticCallCounts::analyze(const Module& m) {
         }
       }
     }
+    f.deleteBody();
   }
+
+  return Error::success();
 }
 
 
@@ -41,11 +106,7 @@ StaticCallCounts::handleInstruction(const CallBase& cb) {
   }
 
   // Update the count for the particular call
-  auto count = counts.find(called);
-  if (counts.end() == count) {
-    count = counts.insert(std::make_pair(called, 0)).first;
-  }
-  ++count->second;
+  ++counts[called];
 }
 
 
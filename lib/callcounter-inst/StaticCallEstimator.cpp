@@ -0,0 +1,323 @@
+
+
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/Support/Format.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+#include "StaticCallEstimator.h"
+
+
+using namespace llvm;
+using callcounter::StaticCallEstimates;
+using callcounter::StaticCallEstimator;
+
+
+namespace callcounter {
+
+AnalysisKey StaticCallEstimator::Key;
+
+}
+
+
+// Static branch probabilities rarely know when a recursion ends, so the calls
+// back into an SCC are capped below one per call of each of its functions.
+// Recursion then multiplies the calls entering an SCC by at most 10.
+static constexpr double MAX_RECURSIVE_CALLS = 0.9;
+
+// The entry frequencies within an SCC are found iteratively, which converges
+// geometrically under the cap above.
+static constexpr unsigned MAX_SCC_ITERATIONS = 1000;
+static constexpr double SCC_TOLERANCE        = 1e-9;
+
+
+// The expected calls of each callee per call of a function.
+using CallWeights = MapVector<const Function*, double>;
+
+
+// Weighs every direct call site by the frequency of its block relative to the
+// entry of its function. Intrinsics are skipped, as in the dynamic counts.
+static DenseMap<const Function*, CallWeights>
+computeCallWeights(Module& m, FunctionAnalysisManager& fam) {
+  DenseMap<const Function*, CallWeights> weights;
+  for (auto& f : m) {
+    if (f.isDeclaration()) {
+      continue;
+    }
+    auto& bfi    = fam.getResult<BlockFrequencyAnalysis>(f);
+    auto& calls  = weights[&f];
+    double entry = bfi.getEntryFreq().getFrequency();
+    for (auto& bb : f) {
+      double frequency = bfi.getBlockFreq(&bb).getFrequency() / entry;
+      for (auto& i : bb) {
+        auto* cb = dyn_cast<CallBase>(&i);
+        if (!cb) {
+          continue;
+        }
+        auto* called = dyn_cast<Function>(cb->getCalledOperand()->stripPointerCasts());
+        if (called && !called->isIntrinsic()) {
+          calls[called] += frequency;
+        }
+      }
+    }
+  }
+  return weights;
+}
+
+
+// Programs start once at main. Without main, e.g. in a library, every
+// externally visible function is assumed to be called once from outside.
+// Functions whose addresses are taken may be called through pointers, which
+// are not resolved, so they are also assumed to be called once.
+static double
+getExternalCalls(const Function& f, bool hasMain) {
+  bool isRoot = hasMain ? "main" == f.getName() : !f.hasLocalLinkage();
+  return isRoot || f.hasAddressTaken() ? 1 : 0;
+}
+
+
+// Solves the entry frequencies within an SCC, given the calls entering it from
+// outside in `entries`.
+static void
+solveSCC(ArrayRef<const Function*> members,
+         const DenseMap<const Function*, CallWeights>& weights,
+         DenseMap<const Function*, double>& entries) {
+  // Only the members are touched, by their positions, so that solving an SCC
+  // costs time in its size alone.
+  SmallDenseMap<const Function*, unsigned, 8> index;
+  for (unsigned i = 0; i < members.size(); ++i) {
+    index[members[i]] = i;
+  }
+
+  SmallVector<double, 8> scales;
+  bool recursive = false;
+  for (auto* f : members) {
+    double internal = 0;
+    for (auto& [callee, weight] : weights.find(f)->second) {
+      internal += index.count(callee) ? weight : 0;
+    }
+    recursive |= internal > 0;
+    scales.push_back(internal > MAX_RECURSIVE_CALLS ? MAX_RECURSIVE_CALLS / internal : 1);
+  }
+  if (!recursive) {
+    return;
+  }
+
+  SmallVector<double, 8> base;
+  for (auto* f : members) {
+    base.push_back(entries.lookup(f));
+  }
+  SmallVector<double, 8> current = base;
+  for (unsigned iteration = 0; iteration < MAX_SCC_ITERATIONS; ++iteration) {
+    SmallVector<double, 8> next = base;
+    for (unsigned i = 0; i < members.size(); ++i) {
+      for (auto& [callee, weight] : weights.find(members[i])->second) {
+        if (auto found = index.find(callee); found != index.end()) {
+          next[found->second] += current[i] * weight * scales[i];
+        }
+      }
+    }
+
+    double change = 0;
+    for (unsigned i = 0; i < members.size(); ++i) {
+      change = std::max(change, std::abs(next[i] - current[i]) / std::max(1.0, next[i]));
+    }
+    current = std::move(next);
+    if (change <= SCC_TOLERANCE) {
+      break;
+    }
+  }
+
+  for (unsigned i = 0; i < members.size(); ++i) {
+    entries[members[i]] = current[i];
+  }
+}
+
+
+// Propagates the entry frequencies over the SCCs of the call graph, callers
+// before callees, so that every function is finished before its calls are
+// passed on.
+void
+StaticCallEstimates::analyze(Module& m, FunctionAnalysisManager& fam) {
+  auto weights = computeCallWeights(m, fam);
+  auto* entry  = m.getFunction("main");
+  bool hasMain = entry && !entry->isDeclaration();
+
+  DenseMap<const Function*, double> entries;
+  DenseMap<const Function*, double> externalCalls;
+  for (auto& f : m) {
+    if (!f.isDeclaration()) {
+      entries[&f] = getExternalCalls(f, hasMain);
+    }
+  }
+
+  CallGraph cg(m);
+  std::vector<std::vector<CallGraphNode*>> sccs;
+  for (auto scc = scc_begin(&cg); !scc.isAtEnd(); ++scc) {
+    sccs.push_back(*scc);
+  }
+
+  // The SCCs are found callees first.
+  for (auto& scc : llvm::reverse(sccs)) {
+    SmallVector<const Function*, 4> members;
+    for (auto* node : scc) {
+      auto* f = node->getFunction();
+      if (f && !f->isDeclaration()) {
+        members.push_back(f);
+      }
+    }
+    if (members.empty()) {
+      continue;
+    }
+
+    solveSCC(members, weights, entries);
+    SmallPtrSet<const Function*, 8> inSCC(members.begin(), members.end());
+    for (auto* f : members) {
+      for (auto& [callee, weight] : weights.find(f)->second) {
+        if (callee->isDeclaration()) {
+          externalCalls[callee] += entries[f] * weight;
+        } else if (!inSCC.count(callee)) {
+          entries[callee] += entries[f] * weight;
+        }
+      }
+    }
+  }
+
+  for (auto& f : m) {
+    if (!f.isDeclaration()) {
+      counts[&f] = entries[&f];
+    } else if (externalCalls.count(&f)) {
+      counts[&f] = externalCalls[&f];
+    }
+  }
+}
+
+
+void
+StaticCallEstimates::print(raw_ostream& out) const {
+  out << "Estimated Function Calls\n"
+      << "========================\n";
+  for (auto& [function, count] : counts) {
+    out << function->getName() << " : " << format("%.0f", count) << "\n";
+  }
+}
+
+
+// Ranks the values from 0, giving tied values the mean of their ranks.
+static std::vector<double>
+getRanks(ArrayRef<double> values) {
+  std::vector<size_t> order(values.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [values](size_t a, size_t b) {
+    return values[a] < values[b];
+  });
+
+  std::vector<double> ranks(values.size());
+  for (size_t first = 0; first < order.size();) {
+    size_t last = first;
+    while (last + 1 < order.size() && values[order[last + 1]] == values[order[first]]) {
+      ++last;
+    }
+    for (size_t i = first; i <= last; ++i) {
+      ranks[order[i]] = (first + last) / 2.0;
+    }
+    first = last + 1;
+  }
+  return ranks;
+}
+
+
+// Spearman's rank correlation, i.e. the Pearson correlation of the ranks, so
+// that only the order of the functions matters and not the scale of the
+// estimates.
+static double
+getRankCorrelation(ArrayRef<double> a, ArrayRef<double> b) {
+  auto aRanks = getRanks(a);
+  auto bRanks = getRanks(b);
+  double mean = (a.size() - 1) / 2.0;
+
+  double covariance = 0;
+  double aVariance  = 0;
+  double bVariance  = 0;
+  for (size_t i = 0; i < a.size(); ++i) {
+    covariance += (aRanks[i] - mean) * (bRanks[i] - mean);
+    aVariance  += (aRanks[i] - mean) * (aRanks[i] - mean);
+    bVariance  += (bRanks[i] - mean) * (bRanks[i] - mean);
+  }
+  if (!aVariance || !bVariance) {
+    return 0;
+  }
+  return covariance / std::sqrt(aVariance * bVariance);
+}
+
+
+// Returns the positions of the `top` largest values.
+static std::vector<size_t>
+getHottest(ArrayRef<double> values, size_t top) {
+  std::vector<size_t> order(values.size());
+  std::iota(order.begin(), order.end(), 0);
+  top = std::min(top, order.size());
+  std::partial_sort(order.begin(),
+                    order.begin() + top,
+                    order.end(),
+                    [values](size_t a, size_t b) {
+                      return values[a] != values[b] ? values[a] > values[b] : a < b;
+                    });
+  order.resize(top);
+  std::sort(order.begin(), order.end());
+  return order;
+}
+
+
+void
+StaticCallEstimates::printComparison(raw_ostream& out,
+                                     ArrayRef<std::string> names,
+                                     ArrayRef<uint64_t> measured,
+                                     size_t top) const {
+  StringMap<uint64_t> measuredCounts;
+  for (size_t id = 0; id < names.size(); ++id) {
+    measuredCounts[names[id]] += measured[id];
+  }
+
+  // Only the functions of the module are compared.
+  std::vector<double> estimates;
+  std::vector<double> actuals;
+  out << "Estimated vs. Measured Calls\n"
+      << "============================\n";
+  for (auto& [function, count] : counts) {
+    auto actual = measuredCounts.lookup(function->getName());
+    estimates.push_back(count);
+    actuals.push_back(actual);
+    out << function->getName() << " : " << format("%.0f", count) << " estimated, "
+        << actual << " measured\n";
+  }
+
+  auto hottestEstimates = getHottest(estimates, top);
+  auto hottestActuals   = getHottest(actuals, top);
+  std::vector<size_t> overlap;
+  std::set_intersection(hottestEstimates.begin(),
+                        hottestEstimates.end(),
+                        hottestActuals.begin(),
+                        hottestActuals.end(),
+                        std::back_inserter(overlap));
+
+  out << "Rank correlation: " << format("%.3f", getRankCorrelation(estimates, actuals))
+      << " over " << estimates.size() << " functions\n"
+      << "Top " << hottestEstimates.size() << " overlap: " << overlap.size() << "\n";
+}
+
+
+StaticCallEstimates
+StaticCallEstimator::run(Module& m, ModuleAnalysisManager& mam) {
+  auto& fam = mam.getResult<FunctionAnalysisManagerModuleProxy>(m).getManager();
+  StaticCallEstimates estimates;
+  estimates.analyze(m, fam);
+  return estimates;
+}
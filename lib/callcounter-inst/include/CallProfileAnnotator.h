@@ -0,0 +1,35 @@
+
+
+#ifndef CALLPROFILEANNOTATOR_H
+#define CALLPROFILEANNOTATOR_H
+
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Pass.h"
+
+
+namespace callcounter {
+
+
+// Feeds measured call counts back into an uninstrumented module, so that the
+// optimizer can use them as in profile guided optimization. Functions in the
+// profile get their calls as real entry counts, the direct call sites within
+// them get their shares of the calls as weights, and the module gets a profile
+// summary so that hot and cold code is told apart by the measured counts.
+struct CallProfileAnnotator : public llvm::PassInfoMixin<CallProfileAnnotator> {
+  // The calls of each function and edge by name, as in a merged profile.
+  llvm::StringMap<uint64_t> counts;
+
+  explicit CallProfileAnnotator(llvm::StringMap<uint64_t> counts)
+    : counts{std::move(counts)} {}
+
+  llvm::PreservedAnalyses run(llvm::Module& m, llvm::ModuleAnalysisManager& mam);
+};
+
+
+}  // namespace callcounter
+
+
+#endif
@@ -6,27 +6,199 @@
 
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/GlobPattern.h"
 #include "llvm/Support/raw_ostream.h"
 
 
+namespace llvm {
+class Loop;
+}
+
+
 namespace callcounter {
 
 
+// How an individual counter update is emitted into the instrumented code.
+enum class CounterUpdate {
+  // Call CaLlCoUnTeR_called(module, id) in the runtime library for every
+  // event.
+  CALL,
+  // Increment the counter in CaLlCoUnTeR_counters directly in the IR.
+  INLINE,
+};
+
+
+// Where the counters live and how concurrent updates to them are handled.
+enum class CounterMode {
+  // Plain increments of the shared table. Updates may be lost when several
+  // threads race on the same counter.
+  PLAIN,
+  // Relaxed atomic increments of the shared table.
+  ATOMIC,
+  // Each thread increments its own block of counters. Blocks are registered
+  // with the runtime and folded into the shared table when threads exit.
+  THREAD_LOCAL,
+};
+
+
+// Whether only a sample of the events is counted. Sampled counts are scaled
+// back up by the runtime, so they estimate the actual counts.
+enum class SamplingMode {
+  NONE,
+  // Count one in every samplePeriod events on average, using a countdown
+  // per thread with a randomized restart.
+  COUNTDOWN,
+  // Count all events during windows of 1ms opened every samplePeriod ms by a
+  // timer in the runtime.
+  WINDOW,
+};
+
+
+struct DynamicCallCounterOptions {
+  CounterUpdate update = CounterUpdate::INLINE;
+  CounterMode mode     = CounterMode::PLAIN;
+  // Merge the updates of a counter within a basic block into one add.
+  bool coalesce = false;
+  // Accumulate the updates of a counter within a loop in a register and add
+  // the total to the counter on the exits of the loop.
+  bool promoteLoops = false;
+  SamplingMode sampling = SamplingMode::NONE;
+  uint64_t samplePeriod = 1000;
+  // Record the targets reached by each indirect call site.
+  bool profileIndirect = false;
+  // Count each (caller, callee) pair of direct calls at its call sites, so the
+  // counts form a weighted dynamic call graph.
+  bool countEdges = false;
+  // Map the counters from the profile file while the program runs, so that
+  // other processes can read them live.
+  bool continuous = false;
+  // Time every call of the counted functions with hooks on entry and exit,
+  // and optionally keep a histogram of the latencies of their calls.
+  bool timing            = false;
+  bool latencyHistograms = false;
+
+  // Only functions whose names match one of `allow` (when given) and none of
+  // `deny` are counted and instrumented.
+  std::vector<llvm::GlobPattern> allow;
+  std::vector<llvm::GlobPattern> deny;
+  // Skip functions with more than maxCalls calls in `profileCounts`, e.g.
+  // from an earlier run. Zero keeps all functions.
+  llvm::StringMap<uint64_t> profileCounts;
+  uint64_t maxCalls = 0;
+  // Skip defined functions with fewer instructions than this.
+  unsigned minInstructions = 0;
+};
+
+
+// A pending update of counter `id` by `amount` to be inserted before
+// `before`. A null amount counts a single event.
+struct CounterSite {
+  llvm::Instruction* before;
+  uint64_t id;
+  llvm::Value* amount = nullptr;
+};
+
+
 struct DynamicCallCounter : public llvm::PassInfoMixin<DynamicCallCounter> {
 
   llvm::DenseMap<llvm::Function*, uint64_t> ids;
   llvm::DenseSet<llvm::Function*> internal;
 
-  DynamicCallCounter() {}
+  // The counter ID of each (caller, callee) pair when counting edges. Edge IDs
+  // follow the function IDs within the same table.
+  llvm::MapVector<std::pair<llvm::Function*, llvm::Function*>, uint64_t> edgeIDs;
+
+  // When counting edges, the defined functions that may be entered other than
+  // by direct calls from instrumented functions, and those among them that are
+  // split, along with the direct calls to redirect to their bodies.
+  llvm::DenseSet<llvm::Function*> enteredElsewhere;
+  llvm::MapVector<llvm::Function*, std::vector<llvm::CallBase*>> splitCalls;
+
+  DynamicCallCounterOptions options;
+  llvm::FunctionCallee counter;
+  llvm::FunctionCallee adder;
+  llvm::FunctionCallee registerThread;
+  llvm::GlobalVariable* localCounters = nullptr;
+
+  // The descriptor that registers the module with the runtime, along with the
+  // tables it refers to. Tables that the module does not need stay null.
+  llvm::GlobalVariable* moduleInfo       = nullptr;
+  llvm::GlobalVariable* counterArray     = nullptr;
+  llvm::GlobalVariable* counterNames     = nullptr;
+  llvm::GlobalVariable* nameOffsets      = nullptr;
+  llvm::GlobalVariable* counterKinds     = nullptr;
+  llvm::GlobalVariable* derivedEdges     = nullptr;
+  llvm::GlobalVariable* indirectTargets  = nullptr;
+  llvm::GlobalVariable* indirectSiteInfo = nullptr;
+  llvm::GlobalVariable* functionAddrs    = nullptr;
+
+  // The caller ID and source line of each profiled indirect call site.
+  std::vector<std::pair<uint64_t, unsigned>> indirectSites;
+  llvm::FunctionCallee indirectCall;
+
+  // The hooks that maintain the shadow stack of timed calls in the runtime.
+  llvm::FunctionCallee timeEnter;
+  llvm::FunctionCallee timeExit;
+  llvm::FunctionCallee timeUnwind;
+
+  llvm::FunctionCallee sampleHit;
+  llvm::GlobalVariable* sampleCountdown = nullptr;
+  llvm::GlobalVariable* sampleEnabled   = nullptr;
+
+  // The counter block of the current thread within the function being
+  // instrumented, when using CounterMode::THREAD_LOCAL.
+  llvm::Value* localBlock = nullptr;
+
+  // The call site updates within the function being instrumented.
+  std::vector<CounterSite> sites;
+
+  explicit DynamicCallCounter(DynamicCallCounterOptions options = {})
+    : options{options} {}
 
   llvm::PreservedAnalyses run(llvm::Module& M, llvm::ModuleAnalysisManager& mam);
 
-  void handleCalledFunction(llvm::Function& f, llvm::FunctionCallee counter);
-  void handleInstruction(llvm::CallBase& cb, llvm::FunctionCallee counter);
+  bool isSelected(llvm::Function& f) const;
+  std::vector<llvm::Function*> selectFunctions(llvm::Module& m) const;
+
+  void handleCalledFunction(llvm::Function& f);
+  void handleInstruction(llvm::CallBase& cb);
+
+  void handleIndirectCall(llvm::CallBase& cb);
+  void addTimingHooks(llvm::Function& f, llvm::ArrayRef<llvm::CallBase*> calls);
+
+  bool isEnteredElsewhere(llvm::Function& f) const;
+  bool isCountedOnEntry(llvm::Function& f) const;
+  llvm::Function* getEdgeCallee(llvm::CallBase& cb) const;
+  void splitEntry(llvm::Function& f, llvm::ArrayRef<llvm::CallBase*> calls);
+  void createCounterTables(llvm::Module& m,
+                           llvm::ArrayRef<std::string> names,
+                           llvm::ArrayRef<uint8_t> kinds);
+  void createEdgeTable(llvm::Module& m);
+  void registerModule(llvm::Module& m);
+
+  void declareSampling(llvm::Module& m);
+  void createIndirectTables(llvm::Module& m);
+
+  void placeUpdates(llvm::Function& f);
+  void promoteCounter(llvm::Loop& loop,
+                      uint64_t id,
+                      llvm::ArrayRef<CounterSite> blockSites,
+                      llvm::ArrayRef<uint64_t> amounts,
+                      std::vector<CounterSite>& updates);
+
+  llvm::Value* loadLocalBlock(llvm::Instruction& before);
+  void emitIncrement(llvm::IRBuilder<>& builder, uint64_t id);
+  void emitIncrement(llvm::IRBuilder<>& builder,
+                     uint64_t id,
+                     llvm::Value* amount);
+  void emitUpdate(llvm::IRBuilder<>& builder, uint64_t id, llvm::Value* amount);
 };
 
 
@@ -4,11 +4,12 @@
 #define STATICCALLCOUNTER_H
 
 
-#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/MapVector.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/Error.h"
 #include "llvm/Support/raw_ostream.h"
 
 
@@ -16,9 +17,16 @@ namespace callcounter {
 
 
 struct StaticCallCounts {
-  llvm::DenseMap<llvm::Function*, uint64_t> counts;
+  // Functions appear in the order of their first call within the module.
+  llvm::MapVector<llvm::Function*, uint64_t> counts;
 
+  // Counts the functions in parallel using llvm::parallel::strategy.
   void analyze(const llvm::Module& m);
+  void analyze(llvm::ArrayRef<const llvm::Function*> functions);
+
+  // Counts a lazily loaded module by materializing one function body at a
+  // time and deleting it after counting.
+  llvm::Error analyzeLazily(llvm::Module& m);
 
   void print(llvm::raw_ostream& out) const;
 
@@ -0,0 +1,57 @@
+
+
+#ifndef STATICCALLESTIMATOR_H
+#define STATICCALLESTIMATOR_H
+
+
+#include "llvm/ADT/MapVector.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <string>
+#include <vector>
+
+
+namespace callcounter {
+
+
+// Predicts the dynamic call counts of a program without running it. Each call
+// site is weighed by the frequency of its block relative to the entry of its
+// function, and the entry frequencies of the functions are propagated over
+// the call graph from `main`, or from every externally visible function of a
+// module without one.
+struct StaticCallEstimates {
+  // The estimated calls of each called or defined function, in module order.
+  llvm::MapVector<const llvm::Function*, double> counts;
+
+  void analyze(llvm::Module& m, llvm::FunctionAnalysisManager& fam);
+
+  void print(llvm::raw_ostream& out) const;
+
+  // Compares the estimates with measured counts, e.g. from a merged dynamic
+  // profile, by their rank correlation and the overlap of the `top` hottest
+  // functions.
+  void printComparison(llvm::raw_ostream& out,
+                       llvm::ArrayRef<std::string> names,
+                       llvm::ArrayRef<uint64_t> measured,
+                       size_t top) const;
+};
+
+
+struct StaticCallEstimator : public llvm::AnalysisInfoMixin<StaticCallEstimator> {
+  using Result = StaticCallEstimates;
+
+  StaticCallEstimator() {}
+
+  StaticCallEstimates run(llvm::Module& m, llvm::ModuleAnalysisManager& mam);
+
+  static llvm::AnalysisKey Key;
+};
+
+
+}  // namespace callcounter
+
+
+#endif
@@ -0,0 +1,218 @@
+
+
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Parallel.h"
+
+#include <algorithm>
+#include <numeric>
+
+#include "ProfileReader.h"
+
+
+using namespace llvm;
+using callcounter::MergedProfile;
+using callcounter::ProfileFile;
+
+
+Expected<ProfileFile>
+ProfileFile::open(StringRef path) {
+  // Large profiles are mapped rather than read when no terminator is needed.
+  auto buffer = MemoryBuffer::getFile(path, false, false);
+  if (!buffer) {
+    return createStringError(buffer.getError(),
+                             "unable to open profile '" + path + "'");
+  }
+
+  ProfileFile file;
+  file.buffer  = std::move(*buffer);
+  auto data    = file.buffer->getBuffer();
+  auto invalid = [&path](const char* reason) {
+    return createStringError(inconvertibleErrorCode(),
+                             "invalid profile '" + path + "': " + reason);
+  };
+
+  if (data.size() < sizeof(profile::Header)) {
+    return invalid("truncated header");
+  }
+  memcpy(&file.header, data.data(), sizeof(profile::Header));
+  auto& header = file.header;
+  if (profile::MAGIC != header.magic) {
+    return invalid("bad magic number");
+  }
+  if (profile::VERSION != header.version) {
+    return invalid("unsupported version");
+  }
+
+  auto countsSize = header.numCounters * sizeof(uint64_t);
+  if (header.countersOffset > data.size()
+      || countsSize > data.size() - header.countersOffset
+      || header.namesOffset > data.size()
+      || header.namesSize > data.size() - header.namesOffset) {
+    return invalid("truncated contents");
+  }
+  auto* counts = data.data() + header.countersOffset;
+  if (reinterpret_cast<uintptr_t>(counts) % alignof(uint64_t)) {
+    return invalid("misaligned counters");
+  }
+
+  file.counts = ArrayRef<uint64_t>(reinterpret_cast<const uint64_t*>(counts),
+                                   header.numCounters);
+  file.names  = data.substr(header.namesOffset, header.namesSize);
+  if (header.numCounters != static_cast<uint64_t>(file.names.count('\0'))) {
+    return invalid("name table does not match counters");
+  }
+  return std::move(file);
+}
+
+
+std::vector<StringRef>
+ProfileFile::getNames() const {
+  std::vector<StringRef> result;
+  result.reserve(header.numCounters);
+  for (auto rest = names; !rest.empty();) {
+    auto [name, next] = rest.split('\0');
+    result.push_back(name);
+    rest = next;
+  }
+  return result;
+}
+
+
+// Kept separate so that the compiler can vectorize the loop.
+static void
+addCounts(uint64_t* __restrict sums, const uint64_t* __restrict counts, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    sums[i] += counts[i];
+  }
+}
+
+
+// Sums profiles with identical name tables. Each task accumulates a strided
+// subset of the files into its own array before the arrays are combined.
+static std::vector<uint64_t>
+sumCounts(ArrayRef<const ProfileFile*> files) {
+  size_t numCounters = files.front()->counts.size();
+  size_t numTasks    = std::min<size_t>(
+      files.size(), parallel::strategy.compute_thread_count());
+
+  std::vector<std::vector<uint64_t>> partial(numTasks);
+  parallelFor(0, numTasks, [&](size_t task) {
+    auto& sums = partial[task];
+    sums.resize(numCounters);
+    for (size_t i = task; i < files.size(); i += numTasks) {
+      addCounts(sums.data(), files[i]->counts.data(), numCounters);
+    }
+  });
+
+  for (size_t task = 1; task < numTasks; ++task) {
+    addCounts(partial.front().data(), partial[task].data(), numCounters);
+  }
+  return std::move(partial.front());
+}
+
+
+Expected<MergedProfile>
+callcounter::mergeProfiles(ArrayRef<std::string> paths) {
+  std::vector<ProfileFile> files(paths.size());
+  std::vector<std::string> errors(paths.size());
+  parallelFor(0, paths.size(), [&](size_t i) {
+    if (auto file = ProfileFile::open(paths[i])) {
+      files[i] = std::move(*file);
+    } else {
+      errors[i] = toString(file.takeError());
+    }
+  });
+  for (auto& error : errors) {
+    if (!error.empty()) {
+      return createStringError(inconvertibleErrorCode(), error);
+    }
+  }
+
+  MergedProfile merged;
+  merged.numProfiles = files.size();
+
+  // Profiles from the same binary share a name table.
+  MapVector<StringRef, std::vector<const ProfileFile*>> groups;
+  for (auto& file : files) {
+    groups[file.names].push_back(&file);
+    merged.sampled |= 0 != (file.header.flags & profile::FLAG_SAMPLED);
+  }
+
+  StringMap<size_t> positions;
+  for (auto& [names, group] : groups) {
+    auto sums = sumCounts(group);
+    auto groupNames = group.front()->getNames();
+    for (auto [name, count] : llvm::zip(groupNames, sums)) {
+      auto [position, inserted] = positions.try_emplace(name, merged.names.size());
+      if (inserted) {
+        merged.names.push_back(name.str());
+        merged.counts.push_back(0);
+      }
+      merged.counts[position->second] += count;
+    }
+  }
+  return std::move(merged);
+}
+
+
+void
+MergedProfile::print(raw_ostream& out, size_t top) const {
+  std::vector<size_t> order(counts.size());
+  std::iota(order.begin(), order.end(), 0);
+  top = std::min(top, order.size());
+  std::partial_sort(order.begin(),
+                    order.begin() + top,
+                    order.end(),
+                    [this](size_t a, size_t b) {
+                      return counts[a] != counts[b] ? counts[a] > counts[b]
+                                                    : names[a] < names[b];
+                    });
+
+  out << "Hottest Functions (" << numProfiles << " profiles"
+      << (sampled ? ", estimated from samples" : "") << ")\n"
+      << "=================\n";
+  for (auto id : ArrayRef<size_t>(order).take_front(top)) {
+    out << names[id] << ": " << counts[id] << "\n";
+  }
+}
+
+
+Error
+MergedProfile::write(StringRef path) const {
+  std::error_code errc;
+  raw_fd_ostream out(path, errc, sys::fs::OF_None);
+  if (errc) {
+    return createStringError(errc, "unable to write profile '" + path + "'");
+  }
+
+  profile::Header header{};
+  header.magic          = profile::MAGIC;
+  header.version        = profile::VERSION;
+  header.flags          = sampled ? profile::FLAG_SAMPLED : 0;
+  header.numCounters    = counts.size();
+  header.countersOffset = sizeof(header);
+  header.namesOffset    = header.countersOffset + counts.size() * sizeof(uint64_t);
+  header.namesSize      = 0;
+  for (auto& name : names) {
+    header.namesSize += name.size() + 1;
+  }
+
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(counts.data()),
+            counts.size() * sizeof(uint64_t));
+  for (auto& name : names) {
+    out << name << '\0';
+  }
+
+  // Write errors such as a full disk only show up here, and must be cleared
+  // before the stream is destroyed.
+  out.close();
+  if (out.has_error()) {
+    errc = out.error();
+    out.clear_error();
+    return createStringError(errc, "unable to write profile '" + path + "'");
+  }
+  return Error::success();
+}
@@ -0,0 +1,72 @@
+
+
+#ifndef PROFILEFORMAT_H
+#define PROFILEFORMAT_H
+
+
+#include <cstdint>
+
+
+namespace callcounter::profile {
+
+
+// A binary profile starts with a Header, followed by an array of numCounters
+// 64 bit counts and a table of NUL terminated function names in the same
+// order as the counts. All offsets are from the start of the file, and all
+// values use the byte order of the profiled machine, so profiles can be
+// mapped into memory and read in place.
+
+// "CCPROFIL" when read as bytes on a little endian machine.
+constexpr uint64_t MAGIC   = 0x4c49464f52504343;
+constexpr uint32_t VERSION = 1;
+
+// Set when the counts were estimated by sampling.
+constexpr uint32_t FLAG_SAMPLED = 1;
+
+// In continuous mode, the counters of a running program are mapped from its
+// profile. They are aligned and padded to this boundary both in memory and in
+// the file, which covers the page sizes of common targets.
+constexpr uint64_t CONTINUOUS_ALIGNMENT = 65536;
+
+// The number of distinct targets recorded for each indirect call site. Other
+// targets share an overflow count.
+constexpr unsigned INDIRECT_TARGETS = 4;
+
+// Each instrumented module registers its counters with the runtime, which
+// merges the counts of all modules by name. Calls to a function are counted
+// on entry where it is defined and at the call sites of other modules, so the
+// call site counts of functions that another module counts on entry are
+// dropped from the merged report.
+enum CounterKind : uint8_t {
+  ENTRY_COUNTER = 0,
+  CALL_COUNTER  = 1,
+  EDGE_COUNTER  = 2,
+};
+
+// Set in the flags of a module whose counters are mapped from its profile.
+constexpr uint64_t MODULE_CONTINUOUS = 1;
+
+// Set in the flags of a module that times its functions, and additionally of
+// one that keeps a histogram of the latencies of their calls.
+constexpr uint64_t MODULE_TIMING     = 2;
+constexpr uint64_t MODULE_HISTOGRAMS = 4;
+
+// Set in the flags of a module that only counts sampled events, so that its
+// counts are estimates, unlike those of modules instrumented without sampling.
+constexpr uint64_t MODULE_SAMPLED    = 8;
+
+struct Header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t flags;
+  uint64_t numCounters;
+  uint64_t countersOffset;
+  uint64_t namesOffset;
+  uint64_t namesSize;
+};
+
+
+}  // namespace callcounter::profile
+
+
+#endif
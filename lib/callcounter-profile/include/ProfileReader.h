@@ -0,0 +1,60 @@
+
+
+#ifndef PROFILEREADER_H
+#define PROFILEREADER_H
+
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ProfileFormat.h"
+
+
+namespace callcounter {
+
+
+// A binary profile written by the runtime library, mapped into memory.
+struct ProfileFile {
+  std::unique_ptr<llvm::MemoryBuffer> buffer;
+  profile::Header header;
+  llvm::ArrayRef<uint64_t> counts;
+  // The NUL terminated names of the functions, in the order of the counts.
+  llvm::StringRef names;
+
+  static llvm::Expected<ProfileFile> open(llvm::StringRef path);
+
+  std::vector<llvm::StringRef> getNames() const;
+};
+
+
+// The counts of any number of profiles, summed by function name.
+struct MergedProfile {
+  std::vector<std::string> names;
+  std::vector<uint64_t> counts;
+  uint64_t numProfiles = 0;
+  // Whether any of the counts were estimated by sampling.
+  bool sampled = false;
+
+  void print(llvm::raw_ostream& out, size_t top) const;
+
+  llvm::Error write(llvm::StringRef path) const;
+};
+
+
+// Sums the given profiles in parallel. Profiles of the same binary share their
+// name tables, so they are summed position by position before the results are
+// combined by name.
+llvm::Expected<MergedProfile> mergeProfiles(llvm::ArrayRef<std::string> paths);
+
+
+}  // namespace callcounter
+
+
+#endif
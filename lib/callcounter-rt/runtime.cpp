@@ -1,6 +1,29 @@
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <unistd.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "ProfileFormat.h"
 
 
 extern "C" {
@@ -11,32 +34,1353 @@ extern "C" {
 // e.g. CCOUNT(entry) yields CaLlCoUnTeR_entry
 #define CCOUNT(X) CaLlCoUnTeR_##X
 
-// The count of the number of functions is stored in a global variable inside
-// the instrumented module.
-extern uint64_t CCOUNT(numFunctions);
+// The number of events until the current thread takes its next sample when
+// sampling with a countdown.
+thread_local int64_t CCOUNT(sampleCountdown) = 0;
+
+// Nonzero while a sampling window is open.
+uint8_t CCOUNT(sampleEnabled) = 0;
+
+using callcounter::profile::INDIRECT_TARGETS;
+
+struct IndirectSite {
+  uintptr_t targets[INDIRECT_TARGETS];
+  uint64_t counts[INDIRECT_TARGETS];
+  uint64_t overflow;
+};
+
+struct IndirectSiteInfo {
+  uint64_t caller;
+  uint64_t line;
+};
+
+struct DerivedEdge {
+  uint64_t callee;
+  uint64_t edge;
+};
+
+// Describes the counters of one instrumented module. Each module registers
+// its descriptor from a constructor, so that separately instrumented objects
+// and shared libraries loaded later all report their counts. Names are NUL
+// terminated strings in a single blob and are found through their offsets.
+// When counting call edges, functions that are not counted on entry are
+// totaled from the derived edges into them. Modules without indirect call
+// profiling have no indirect call tables.
+struct ModuleInfo {
+  uint64_t numCounters;
+  uint64_t* counters;
+  const char* names;
+  const uint32_t* nameOffsets;
+  const uint8_t* kinds;
+  uint64_t numDerivedEdges;
+  const DerivedEdge* derivedEdges;
+  uint64_t numIndirectSites;
+  IndirectSite* indirectTargets;
+  const IndirectSiteInfo* indirectSiteInfo;
+  void* const* functionAddrs;
+  uint64_t flags;
+};
+
+uint64_t* CCOUNT(registerThread)(ModuleInfo* module, uint64_t** slot);
+void CCOUNT(print)();
+}
+
+
+namespace {
+
+const char*
+getCounterName(const ModuleInfo& module, size_t id) {
+  return module.names + module.nameOffsets[id];
+}
+
+
+// Counter blocks are cache line aligned so that threads never share lines.
+constexpr size_t CACHE_LINE_SIZE = 64;
+
+std::mutex registryLock;
+
+// Call latencies are bucketed by their base 2 logarithm. Bucket b counts the
+// calls of [2^b, 2^(b+1)) cycles, except that the first also counts calls of
+// no cycles and the last all longer calls.
+constexpr unsigned LATENCY_BUCKETS = 48;
+
+
+// Updates a value owned by the current thread that others may read.
+void
+addRelaxed(uint64_t& value, uint64_t amount) {
+  __atomic_store_n(&value, __atomic_load_n(&value, __ATOMIC_RELAXED) + amount,
+                   __ATOMIC_RELAXED);
+}
+
+
+// The cycles spent in each function of a timed module, either as measured by
+// one thread or as totaled for the module:
+// - calls: the number of timed calls
+// - inclusive: the cycles from entry to exit, including callees, counted for
+//   the outermost call of recursive functions only
+// - self: the cycles excluding those of timed callees
+// - histogram: the LATENCY_BUCKETS counts of each function, when kept
+struct Timings {
+  std::vector<uint64_t> calls;
+  std::vector<uint64_t> inclusive;
+  std::vector<uint64_t> self;
+  std::vector<uint64_t> histogram;
+  bool histograms = false;
+
+  Timings() = default;
+
+  Timings(size_t numFunctions, bool histograms)
+    : calls(numFunctions),
+      inclusive(numFunctions),
+      self(numFunctions),
+      histogram(histograms ? numFunctions * LATENCY_BUCKETS : 0),
+      histograms{histograms} {}
+
+  size_t
+  size() const {
+    return calls.size();
+  }
+
+  void
+  resize(size_t numFunctions) {
+    calls.resize(numFunctions);
+    inclusive.resize(numFunctions);
+    self.resize(numFunctions);
+    histogram.resize(histograms ? numFunctions * LATENCY_BUCKETS : 0);
+  }
+
+  // Adds function `otherID` of `other`, which may still be updated by its
+  // thread, to function `id`.
+  void
+  add(size_t id, const Timings& other, size_t otherID) {
+    calls[id]     += __atomic_load_n(&other.calls[otherID], __ATOMIC_RELAXED);
+    inclusive[id] += __atomic_load_n(&other.inclusive[otherID], __ATOMIC_RELAXED);
+    self[id]      += __atomic_load_n(&other.self[otherID], __ATOMIC_RELAXED);
+    if (histograms && other.histograms) {
+      for (unsigned bucket = 0; bucket < LATENCY_BUCKETS; ++bucket) {
+        histogram[id * LATENCY_BUCKETS + bucket] += __atomic_load_n(
+            &other.histogram[otherID * LATENCY_BUCKETS + bucket], __ATOMIC_RELAXED);
+      }
+    }
+  }
+
+  void
+  add(const Timings& other) {
+    for (size_t id = 0; id < other.size(); ++id) {
+      add(id, other, id);
+    }
+  }
+};
+
+// The runtime's view of a registered module. Unloaded modules are retired
+// with a copy of their names and counts for the final report.
+struct ModuleState {
+  ModuleInfo* info = nullptr;
+
+  // The counter blocks of threads that have not yet exited.
+  std::vector<uint64_t*> liveBlocks;
+
+  // Events from threads whose blocks have already been flushed, e.g. from
+  // other thread local destructors, are collected here.
+  uint64_t* orphanBlock = nullptr;
+
+  // Whether the module only counts sampled events. Kept from the flags of the
+  // module, which are gone once it is unloaded.
+  bool sampled = false;
+
+  bool retired = false;
+  std::vector<std::string> names;
+  std::vector<uint8_t> kinds;
+  std::vector<uint64_t> counts;
+  std::string indirectReport;
+
+  // The timings of exited threads, or of all threads once the module is
+  // retired, and those of the threads still running. The timings stay empty
+  // when the module is not timed.
+  Timings timings;
+  std::vector<const Timings*> liveTimings;
+
+  // The profile mapped over the counters in continuous mode, or -1.
+  int continuousFile = -1;
+  std::string continuousPath;
+};
+
+// All modules in the order that they registered. States are never freed, so
+// that exiting threads can still find the modules of their blocks. Modules
+// register from early constructors that may run before the static
+// initializers of the runtime, so the list is created on first use.
+std::vector<ModuleState*>&
+getModules() {
+  static auto* modules = new std::vector<ModuleState*>;
+  return *modules;
+}
+
+
+// Returns the state of a module that has not been unloaded, or null.
+// The registry lock must be held.
+ModuleState*
+findModule(const ModuleInfo* info) {
+  for (auto* state : getModules()) {
+    if (!state->retired && state->info == info) {
+      return state;
+    }
+  }
+  return nullptr;
+}
+
+
+uint64_t*
+allocateBlock(const ModuleInfo& module) {
+  size_t size = module.numCounters * sizeof(uint64_t);
+  size        = (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+  auto* block = static_cast<uint64_t*>(
+      aligned_alloc(CACHE_LINE_SIZE, std::max(size, CACHE_LINE_SIZE)));
+  if (!block) {
+    fprintf(stderr, "callcounter: unable to allocate thread counters\n");
+    abort();
+  }
+  memset(block, 0, size);
+  return block;
+}
+
+
+// The registry lock must be held.
+uint64_t*
+getOrphanBlock(ModuleState& state) {
+  if (!state.orphanBlock) {
+    state.orphanBlock = allocateBlock(*state.info);
+  }
+  return state.orphanBlock;
+}
+
+
+// Folds the blocks of a thread into the shared tables of their modules when
+// the thread exits. Blocks of modules that were unloaded in the meantime have
+// already been counted.
+struct ThreadCounters {
+  struct Block {
+    ModuleState* module;
+    uint64_t* counters;
+    // The thread local pointer through which the module finds the block, if
+    // it has one.
+    uint64_t** slot;
+  };
+
+  std::vector<Block> blocks;
+  bool exited = false;
+
+  ~ThreadCounters() {
+    exited = true;
+
+    std::lock_guard<std::mutex> guard{registryLock};
+    for (auto& block : blocks) {
+      auto& state = *block.module;
+      if (!state.retired) {
+        for (size_t id = 0; id < state.info->numCounters; ++id) {
+          __atomic_fetch_add(&state.info->counters[id],
+                             __atomic_load_n(&block.counters[id], __ATOMIC_RELAXED),
+                             __ATOMIC_RELAXED);
+        }
+        auto& live = state.liveBlocks;
+        live.erase(std::find(live.begin(), live.end(), block.counters));
+        if (block.slot) {
+          *block.slot = getOrphanBlock(state);
+        }
+      }
+      free(block.counters);
+    }
+    blocks.clear();
+  }
+};
+
+thread_local ThreadCounters threadCounters;
+
+
+// Reads the time stamp counter, or a nanosecond clock on targets without one.
+uint64_t
+readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+
+// The timings of a module measured by one thread, along with the number of
+// calls of each function in progress, so that recursive calls are not counted
+// twice in the inclusive cycles.
+struct TimingBlock {
+  ModuleState* module;
+  Timings timings;
+  std::vector<uint32_t> active;
+};
+
+// A call in progress on the shadow stack of a thread.
+struct TimingFrame {
+  TimingBlock* block;
+  uint64_t id;
+  uint64_t start;
+  // The inclusive cycles of the timed callees that have returned so far.
+  uint64_t callees;
+};
+
+// Returned when entering a function that cannot be timed, so that the frames
+// of the thread are left alone when it exits.
+constexpr uint64_t NO_FRAME = UINT64_MAX;
+
+
+// The shadow stack and the timing blocks of a thread. Blocks are folded into
+// their modules when the thread exits.
+struct ThreadTimings {
+  std::vector<TimingFrame> stack;
+  std::vector<TimingBlock*> blocks;
+  // The block of the most recently entered module, which is usually the
+  // only one.
+  TimingBlock* last = nullptr;
+  bool exited = false;
+
+  // Closes the innermost frame at `end`.
+  void
+  close(uint64_t end) {
+    auto frame = stack.back();
+    stack.pop_back();
+
+    auto& timings   = frame.block->timings;
+    auto id         = frame.id;
+    uint64_t cycles = end > frame.start ? end - frame.start : 0;
+    addRelaxed(timings.calls[id], 1);
+    addRelaxed(timings.self[id], cycles > frame.callees ? cycles - frame.callees : 0);
+    if (0 == --frame.block->active[id]) {
+      addRelaxed(timings.inclusive[id], cycles);
+    }
+    if (timings.histograms) {
+      unsigned bucket = cycles < 2 ? 0 : 63 - __builtin_clzll(cycles);
+      bucket          = std::min(bucket, LATENCY_BUCKETS - 1);
+      addRelaxed(timings.histogram[id * LATENCY_BUCKETS + bucket], 1);
+    }
+    if (!stack.empty()) {
+      stack.back().callees += cycles;
+    }
+  }
+
+  ~ThreadTimings() {
+    // Calls still in progress, e.g. when the thread exits from within them,
+    // end now.
+    auto end = readCycles();
+    while (!stack.empty()) {
+      close(end);
+    }
+    exited = true;
+
+    std::lock_guard<std::mutex> guard{registryLock};
+    for (auto* block : blocks) {
+      auto& state = *block->module;
+      if (!state.retired) {
+        state.timings.add(block->timings);
+        auto& live = state.liveTimings;
+        live.erase(std::find(live.begin(), live.end(), &block->timings));
+      }
+      delete block;
+    }
+    blocks.clear();
+    last = nullptr;
+  }
+};
+
+thread_local ThreadTimings threadTimings;
+
+
+// These match callcounter::SamplingMode in the instrumentation.
+enum SamplingMode : uint32_t {
+  NO_SAMPLING = 0,
+  COUNTDOWN   = 1,
+  WINDOW      = 2,
+};
+
+using Clock = std::chrono::steady_clock;
+
+std::atomic<bool> samplingStarted{false};
+uint32_t samplingMode = NO_SAMPLING;
+Clock::time_point samplingStart;
+
+// The total time that sampling windows have been open and the start of the
+// current window, both in nanoseconds since sampling started.
+std::atomic<int64_t> windowNanos{0};
+std::atomic<int64_t> windowOpened{0};
+
+constexpr auto SAMPLE_WINDOW = std::chrono::milliseconds(1);
+
+thread_local bool countdownStarted = false;
+thread_local uint64_t randomState  = 0;
+
 
-// An array of information for each function ID is stored within the
-// instrumented module.
-extern struct {
-  char* name;
-  uint64_t count;
-} CCOUNT(functionInfo)[];
+int64_t
+nanosSinceStart(Clock::time_point time) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(time - samplingStart)
+      .count();
+}
+
+
+// Returns a random countdown uniformly distributed over [1, 2 * period - 1].
+// Randomizing the countdowns keeps regular call patterns from aliasing with
+// the sampling period.
+uint64_t
+nextInterval(uint64_t period) {
+  if (!randomState) {
+    randomState = reinterpret_cast<uintptr_t>(&randomState)
+                  ^ Clock::now().time_since_epoch().count();
+    randomState |= 1;
+  }
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 7;
+  randomState ^= randomState << 17;
+  return period <= 1 ? 1 : 1 + randomState % (2 * period - 1);
+}
 
 
+// Opens a window of SAMPLE_WINDOW at the start of every period.
 void
-CCOUNT(called)(uint64_t id) {
-  ++CCOUNT(functionInfo)[id].count;
+runSampleWindows(uint64_t periodMillis) {
+  auto period = std::chrono::milliseconds(periodMillis);
+  while (true) {
+    auto opened = Clock::now();
+    windowOpened.store(nanosSinceStart(opened));
+    __atomic_store_n(&CCOUNT(sampleEnabled), 1, __ATOMIC_RELAXED);
+    std::this_thread::sleep_for(SAMPLE_WINDOW);
+    __atomic_store_n(&CCOUNT(sampleEnabled), 0, __ATOMIC_RELAXED);
+    windowNanos += nanosSinceStart(Clock::now()) - nanosSinceStart(opened);
+    std::this_thread::sleep_for(period - SAMPLE_WINDOW);
+  }
+}
+
+
+// Returns the factor that scales counts gathered in sampling windows by the
+// fraction of time that the windows were open. Countdown samples are already
+// scaled when recorded.
+double
+getSampleScale() {
+  if (WINDOW != samplingMode) {
+    return 1;
+  }
+
+  int64_t elapsed = nanosSinceStart(Clock::now());
+  int64_t open    = windowNanos.load();
+  if (__atomic_load_n(&CCOUNT(sampleEnabled), __ATOMIC_RELAXED)) {
+    open += elapsed - windowOpened.load();
+  }
+  if (open <= 0 || open >= elapsed) {
+    return 1;
+  }
+  return static_cast<double>(elapsed) / open;
+}
+
+
+// Whether the counts of a module are estimates. Modules instrumented without
+// sampling count every event, even when others in the program sample.
+bool
+isEstimated(const ModuleState& state) {
+  return state.sampled && NO_SAMPLING != samplingMode;
 }
 
 
+// Totals the calls of functions that are only counted through their edges.
 void
-CCOUNT(print)() {
+addDerivedCounts(const ModuleInfo& module, std::vector<uint64_t>& counts) {
+  for (size_t i = 0; i < module.numDerivedEdges; ++i) {
+    auto& edge = module.derivedEdges[i];
+    counts[edge.callee] += counts[edge.edge];
+  }
+}
+
+
+// Sums the shared counts of a module with those of threads that are still
+// running. The registry lock must be held.
+std::vector<uint64_t>
+collectCounts(const ModuleState& state) {
+  if (state.retired) {
+    return state.counts;
+  }
+
+  auto& module = *state.info;
+  std::vector<uint64_t> counts(module.numCounters);
+  auto blocks = state.liveBlocks;
+  if (state.orphanBlock) {
+    blocks.push_back(state.orphanBlock);
+  }
+
+  for (size_t id = 0; id < module.numCounters; ++id) {
+    counts[id] = __atomic_load_n(&module.counters[id], __ATOMIC_RELAXED);
+    for (auto* block : blocks) {
+      counts[id] += __atomic_load_n(&block[id], __ATOMIC_RELAXED);
+    }
+  }
+  addDerivedCounts(module, counts);
+  return counts;
+}
+
+
+// Sums the timings of a module over its exited and running threads. The
+// registry lock must be held.
+Timings
+collectTimings(const ModuleState& state) {
+  auto timings = state.timings;
+  if (!state.retired) {
+    for (auto* live : state.liveTimings) {
+      timings.add(*live);
+    }
+  }
+  return timings;
+}
+
+
+const char*
+getCounterName(const ModuleState& state, size_t id) {
+  return state.retired ? state.names[id].c_str() : getCounterName(*state.info, id);
+}
+
+
+uint8_t
+getCounterKind(const ModuleState& state, size_t id) {
+  return state.retired ? state.kinds[id] : state.info->kinds[id];
+}
+
+
+// The counts of several modules, merged by name. They are estimates when any
+// of the modules was sampled.
+struct Report {
+  std::vector<std::string> names;
+  std::vector<uint64_t> counts;
+  bool sampled = false;
+};
+
+
+// Returns the names of the functions that some of the modules count on entry.
+// A function defined in one module may also be counted at the call sites of
+// others, so call site counts only remain for functions that no module counts
+// on entry. The registry lock must be held.
+std::unordered_set<std::string>
+collectCountedOnEntry(const std::vector<ModuleState*>& modules) {
+  std::unordered_set<std::string> counted;
+  for (auto* state : modules) {
+    auto numCounters = state->retired ? state->counts.size() : state->info->numCounters;
+    for (size_t id = 0; id < numCounters; ++id) {
+      if (callcounter::profile::ENTRY_COUNTER == getCounterKind(*state, id)) {
+        counted.insert(getCounterName(*state, id));
+      }
+    }
+  }
+  return counted;
+}
+
+
+// Merges the counts of all modules whose counters are not mapped from their
+// own profiles. Only the counts of sampled modules are scaled. The registry
+// lock must be held.
+Report
+collectReport() {
+  using callcounter::profile::CALL_COUNTER;
+
+  std::vector<ModuleState*> reported;
+  for (auto* state : getModules()) {
+    if (-1 == state->continuousFile) {
+      reported.push_back(state);
+    }
+  }
+
+  auto counted = collectCountedOnEntry(reported);
+  double scale = getSampleScale();
+  Report report;
+  std::unordered_map<std::string, size_t> positions;
+  for (auto* state : reported) {
+    auto counts = collectCounts(*state);
+    if (isEstimated(*state)) {
+      report.sampled = true;
+      for (auto& count : counts) {
+        count = std::llround(count * scale);
+      }
+    }
+    for (size_t id = 0; id < counts.size(); ++id) {
+      std::string name = getCounterName(*state, id);
+      if (CALL_COUNTER == getCounterKind(*state, id) && counted.count(name)) {
+        continue;
+      }
+      auto [position, inserted] = positions.try_emplace(name, report.names.size());
+      if (inserted) {
+        report.names.push_back(name);
+        report.counts.push_back(0);
+      }
+      report.counts[position->second] += counts[id];
+    }
+  }
+  return report;
+}
+
+
+void
+printCounts(const Report& report) {
   printf("=====================\n"
          "Direct Function Calls\n"
          "=====================\n");
-  for (size_t id = 0; id < CCOUNT(numFunctions); ++id) {
-    auto& info = CCOUNT(functionInfo)[id];
-    printf("%s: %lu\n", info.name, info.count);
+  if (report.sampled) {
+    printf("(estimated from samples)\n");
+  }
+  for (size_t id = 0; id < report.counts.size(); ++id) {
+    printf("%s: %lu\n", report.names[id].c_str(), report.counts[id]);
+  }
+}
+
+
+// The timings of all timed modules, merged by name like their counts.
+struct TimingReport {
+  std::vector<std::string> names;
+  Timings timings;
+};
+
+
+// The registry lock must be held.
+TimingReport
+collectTimingReport() {
+  using callcounter::profile::CALL_COUNTER;
+
+  std::vector<ModuleState*> timed;
+  bool histograms = false;
+  for (auto* state : getModules()) {
+    if (state->timings.size()) {
+      timed.push_back(state);
+      histograms |= state->timings.histograms;
+    }
+  }
+
+  auto counted = collectCountedOnEntry(timed);
+  TimingReport report;
+  report.timings.histograms = histograms;
+  std::unordered_map<std::string, size_t> positions;
+  for (auto* state : timed) {
+    auto timings = collectTimings(*state);
+    for (size_t id = 0; id < timings.size(); ++id) {
+      std::string name = getCounterName(*state, id);
+      if (!timings.calls[id]
+          || (CALL_COUNTER == getCounterKind(*state, id) && counted.count(name))) {
+        continue;
+      }
+      auto [position, inserted] = positions.try_emplace(name, report.names.size());
+      if (inserted) {
+        report.names.push_back(name);
+        report.timings.resize(report.names.size());
+      }
+      report.timings.add(position->second, timings, id);
+    }
+  }
+  return report;
+}
+
+
+// Lists the functions by their self cycles, the hottest first, followed by
+// the latency histograms when they were kept.
+void
+printTimings(FILE* out) {
+  auto report   = collectTimingReport();
+  auto& timings = report.timings;
+  std::vector<size_t> order(report.names.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&timings](size_t a, size_t b) {
+    return timings.self[a] > timings.self[b];
+  });
+
+  fprintf(out,
+          "===============\n"
+          "Function Cycles\n"
+          "===============\n");
+  for (auto id : order) {
+    fprintf(out,
+            "%s: %lu calls, %lu inclusive, %lu self\n",
+            report.names[id].c_str(),
+            timings.calls[id],
+            timings.inclusive[id],
+            timings.self[id]);
+  }
+
+  if (!timings.histograms) {
+    return;
+  }
+  fprintf(out,
+          "=======================\n"
+          "Call Latencies (cycles)\n"
+          "=======================\n");
+  for (auto id : order) {
+    fprintf(out, "%s:", report.names[id].c_str());
+    for (unsigned bucket = 0; bucket < LATENCY_BUCKETS; ++bucket) {
+      auto count = timings.histogram[id * LATENCY_BUCKETS + bucket];
+      if (!count) {
+        continue;
+      }
+      uint64_t low = bucket ? uint64_t{1} << bucket : 0;
+      if (bucket + 1 < LATENCY_BUCKETS) {
+        fprintf(out, " [%lu,%lu)=%lu", low, uint64_t{2} << bucket, count);
+      } else {
+        fprintf(out, " [%lu,)=%lu", low, count);
+      }
+    }
+    fprintf(out, "\n");
+  }
+}
+
+
+// The address and name of each function known to the loaded modules, sorted
+// by address.
+using FunctionNames = std::vector<std::pair<uintptr_t, const char*>>;
+
+
+// The registry lock must be held.
+FunctionNames
+collectFunctionNames() {
+  FunctionNames functions;
+  for (auto* state : getModules()) {
+    if (state->retired || !state->info->functionAddrs) {
+      continue;
+    }
+    auto& module = *state->info;
+    for (size_t id = 0; id < module.numCounters; ++id) {
+      if (auto* address = module.functionAddrs[id]) {
+        functions.emplace_back(reinterpret_cast<uintptr_t>(address),
+                               getCounterName(module, id));
+      }
+    }
+  }
+  std::sort(functions.begin(), functions.end());
+  return functions;
+}
+
+
+// Finds the name of an indirect call target, preferring the names of the
+// instrumented modules.
+std::string
+getTargetName(uintptr_t target, const FunctionNames& functions) {
+  auto found = std::lower_bound(
+      functions.begin(),
+      functions.end(),
+      target,
+      [](auto& function, uintptr_t address) { return function.first < address; });
+  if (functions.end() != found && found->first == target) {
+    return found->second;
+  }
+
+  Dl_info info;
+  if (dladdr(reinterpret_cast<void*>(target), &info) && info.dli_sname
+      && reinterpret_cast<uintptr_t>(info.dli_saddr) == target) {
+    return info.dli_sname;
+  }
+  char address[32];
+  snprintf(address, sizeof(address), "0x%lx", target);
+  return address;
+}
+
+
+void
+printIndirectTargets(FILE* out, const ModuleInfo& module, const FunctionNames& functions) {
+  for (size_t site = 0; site < module.numIndirectSites; ++site) {
+    auto& entry = module.indirectTargets[site];
+    auto& info  = module.indirectSiteInfo[site];
+    fprintf(out,
+            "%s:%lu (site %zu):",
+            getCounterName(module, info.caller),
+            info.line,
+            site);
+
+    unsigned order[INDIRECT_TARGETS];
+    for (unsigned slot = 0; slot < INDIRECT_TARGETS; ++slot) {
+      order[slot] = slot;
+    }
+    std::sort(order, order + INDIRECT_TARGETS, [&entry](auto a, auto b) {
+      return entry.counts[a] > entry.counts[b];
+    });
+    for (auto slot : order) {
+      uint64_t count = __atomic_load_n(&entry.counts[slot], __ATOMIC_RELAXED);
+      if (entry.targets[slot] && count) {
+        fprintf(out,
+                " %s=%lu",
+                getTargetName(entry.targets[slot], functions).c_str(),
+                count);
+      }
+    }
+    fprintf(out, " <other>=%lu\n", entry.overflow);
+  }
+}
+
+
+// The registry lock must be held.
+void
+printIndirectTargets(FILE* out) {
+  auto functions = collectFunctionNames();
+  fprintf(out,
+          "=====================\n"
+          "Indirect Call Targets\n"
+          "=====================\n");
+  for (auto* state : getModules()) {
+    if (state->retired) {
+      fputs(state->indirectReport.c_str(), out);
+    } else {
+      printIndirectTargets(out, *state->info, functions);
+    }
+  }
+}
+
+
+// Replaces each "%p" in the configured path with the process ID so that
+// concurrent runs of a program do not overwrite each other's profiles.
+std::string
+expandProfilePath(const char* pattern) {
+  std::string path;
+  for (const char* c = pattern; *c; ++c) {
+    if ('%' == c[0] && 'p' == c[1]) {
+      path += std::to_string(getpid());
+      ++c;
+    } else {
+      path += *c;
+    }
+  }
+  return path;
+}
+
+
+// Returns the path of the next profile that the process writes. When modules
+// in continuous mode each have their own profile, all but the first get a
+// numeric suffix.
+unsigned numProfiles = 0;
+
+std::string
+getNextProfilePath(const char* pattern) {
+  auto path = expandProfilePath(pattern);
+  if (numProfiles) {
+    path += "." + std::to_string(numProfiles);
+  }
+  ++numProfiles;
+  return path;
+}
+
+
+std::string
+getProfileNames(const std::vector<std::string>& names) {
+  std::string blob;
+  for (auto& name : names) {
+    blob += name;
+    blob.push_back('\0');
+  }
+  return blob;
+}
+
+
+void
+writeProfile(const Report& report, const std::string& path) {
+  FILE* file = fopen(path.c_str(), "wb");
+  if (!file) {
+    fprintf(stderr, "callcounter: unable to write profile '%s'\n", path.c_str());
+    return;
+  }
+
+  auto& counts = report.counts;
+  auto names   = getProfileNames(report.names);
+  callcounter::profile::Header header{};
+  header.magic          = callcounter::profile::MAGIC;
+  header.version        = callcounter::profile::VERSION;
+  header.flags          = report.sampled ? callcounter::profile::FLAG_SAMPLED : 0;
+  header.numCounters    = counts.size();
+  header.countersOffset = sizeof(header);
+  header.namesOffset    = header.countersOffset + counts.size() * sizeof(uint64_t);
+  header.namesSize      = names.size();
+
+  fwrite(&header, sizeof(header), 1, file);
+  fwrite(counts.data(), sizeof(uint64_t), counts.size(), file);
+  fwrite(names.data(), 1, names.size(), file);
+  fclose(file);
+}
+
+
+void
+writeIndirectReport(const std::string& profilePath) {
+  auto reportPath = profilePath + ".indirect";
+  if (FILE* report = fopen(reportPath.c_str(), "w")) {
+    printIndirectTargets(report);
+    fclose(report);
+  }
+}
+
+
+void
+writeTimingReport(const std::string& profilePath) {
+  auto reportPath = profilePath + ".timing";
+  if (FILE* report = fopen(reportPath.c_str(), "w")) {
+    printTimings(report);
+    fclose(report);
+  }
+}
+
+
+bool
+writeAll(int fd, const void* data, size_t size, off_t offset) {
+  auto* bytes = static_cast<const char*>(data);
+  while (size) {
+    auto written = pwrite(fd, bytes, size, offset);
+    if (written <= 0) {
+      return false;
+    }
+    bytes  += written;
+    size   -= written;
+    offset += written;
+  }
+  return true;
+}
+
+
+// Creates the profile of a module in continuous mode and maps its counts over
+// the counters of the module, so that every update lands in the file and
+// other processes can read the counts while the program runs. The profile is
+// written to CALLCOUNTER_PROFILE, or callcounter.<pid>.prof by default.
+// Counts recorded before the mapping are copied into the file, but updates
+// racing with the mapping itself may be lost, so modules register from early
+// constructors. On failure, the counts simply stay in memory.
+// The registry lock must be held.
+void
+mapCounters(ModuleState& state) {
+  using namespace callcounter::profile;
+
+  auto& module  = *state.info;
+  auto* pattern = getenv("CALLCOUNTER_PROFILE");
+  auto path     = getNextProfilePath(pattern && *pattern ? pattern : "callcounter.%p.prof");
+
+  auto numCounters = module.numCounters;
+  auto countsSize  = numCounters * sizeof(uint64_t);
+  auto mappedSize  = (countsSize + CONTINUOUS_ALIGNMENT - 1) / CONTINUOUS_ALIGNMENT
+                    * CONTINUOUS_ALIGNMENT;
+  auto address     = reinterpret_cast<uintptr_t>(module.counters);
+  if (!numCounters || address % CONTINUOUS_ALIGNMENT
+      || static_cast<uint64_t>(sysconf(_SC_PAGESIZE)) > CONTINUOUS_ALIGNMENT) {
+    fprintf(stderr, "callcounter: unable to map the counters of '%s'\n", path.c_str());
+    return;
+  }
+
+  std::vector<std::string> names;
+  for (size_t id = 0; id < numCounters; ++id) {
+    names.push_back(getCounterName(module, id));
+  }
+  auto blob = getProfileNames(names);
+  Header header{};
+  header.magic          = MAGIC;
+  header.version        = VERSION;
+  header.numCounters    = numCounters;
+  header.countersOffset = CONTINUOUS_ALIGNMENT;
+  header.namesOffset    = header.countersOffset + mappedSize;
+  header.namesSize      = blob.size();
+
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  bool created = -1 != fd
+      && 0 == ftruncate(fd, header.namesOffset + header.namesSize)
+      && writeAll(fd, &header, sizeof(header), 0)
+      && writeAll(fd, module.counters, countsSize, header.countersOffset)
+      && writeAll(fd, blob.data(), blob.size(), header.namesOffset)
+      && MAP_FAILED != mmap(module.counters,
+                            mappedSize,
+                            PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_FIXED,
+                            fd,
+                            header.countersOffset);
+  if (!created) {
+    fprintf(stderr, "callcounter: unable to create profile '%s'\n", path.c_str());
+    if (-1 != fd) {
+      close(fd);
+    }
+    return;
+  }
+
+  state.continuousFile = fd;
+  state.continuousPath = path;
+}
+
+
+// Returns the state of a module, registering it on first use. The first
+// registration schedules the report for when the program exits, after the
+// destructors of the program itself have run. The registry lock must be held.
+ModuleState&
+getModule(ModuleInfo* info) {
+  if (auto* state = findModule(info)) {
+    return *state;
+  }
+
+  auto* state = new ModuleState{};
+  state->info    = info;
+  state->sampled = info->flags & callcounter::profile::MODULE_SAMPLED;
+  auto& modules = getModules();
+  modules.push_back(state);
+  if (1 == modules.size()) {
+    atexit(CCOUNT(print));
+  }
+  if (info->flags & callcounter::profile::MODULE_CONTINUOUS) {
+    mapCounters(*state);
+  }
+  if (info->flags & callcounter::profile::MODULE_TIMING) {
+    state->timings = Timings(info->numCounters,
+                             info->flags & callcounter::profile::MODULE_HISTOGRAMS);
+  }
+  return *state;
+}
+
+}  // namespace
+
+
+extern "C" {
+
+
+// Registers the counters of a module with the runtime. Every instrumented
+// module calls this from a constructor. Modules in shared libraries must
+// resolve this to the same runtime as the rest of the program, e.g. by
+// linking the runtime into the executable and exporting its symbols, so that
+// all of them end up in a single report.
+void
+CCOUNT(register)(ModuleInfo* module) {
+  std::lock_guard<std::mutex> guard{registryLock};
+  getModule(module);
+}
+
+
+// Retires a module that is being unloaded, e.g. by dlclose. Its names,
+// counts, and indirect call targets are copied while its tables still exist.
+void
+CCOUNT(unregister)(ModuleInfo* module) {
+  std::lock_guard<std::mutex> guard{registryLock};
+  auto* state = findModule(module);
+  if (!state) {
+    return;
+  }
+
+  state->counts = collectCounts(*state);
+  for (size_t id = 0; id < module->numCounters; ++id) {
+    state->names.push_back(getCounterName(*module, id));
+    state->kinds.push_back(module->kinds[id]);
+  }
+  if (module->numIndirectSites) {
+    char* text  = nullptr;
+    size_t size = 0;
+    if (FILE* report = open_memstream(&text, &size)) {
+      printIndirectTargets(report, *module, collectFunctionNames());
+      fclose(report);
+      state->indirectReport.assign(text, size);
+    }
+    free(text);
+  }
+
+  state->timings = collectTimings(*state);
+  state->liveTimings.clear();
+
+  // Threads still own their blocks and free them when they exit.
+  free(state->orphanBlock);
+  state->orphanBlock = nullptr;
+  state->liveBlocks.clear();
+  state->retired = true;
+  state->info    = nullptr;
+}
+
+
+void
+CCOUNT(add)(ModuleInfo* module, uint64_t id, uint64_t amount) {
+  module->counters[id] += amount;
+}
+
+
+void
+CCOUNT(called)(ModuleInfo* module, uint64_t id) {
+  CCOUNT(add)(module, id, 1);
+}
+
+
+void
+CCOUNT(addAtomic)(ModuleInfo* module, uint64_t id, uint64_t amount) {
+  __atomic_fetch_add(&module->counters[id], amount, __ATOMIC_RELAXED);
+}
+
+
+void
+CCOUNT(calledAtomic)(ModuleInfo* module, uint64_t id) {
+  CCOUNT(addAtomic)(module, id, 1);
+}
+
+
+// Allocates the counter block of the current thread for a module and stores
+// it to `slot`, the thread local pointer of the module, when it has one.
+uint64_t*
+CCOUNT(registerThread)(ModuleInfo* module, uint64_t** slot) {
+  uint64_t* block = nullptr;
+  {
+    std::lock_guard<std::mutex> guard{registryLock};
+    auto& state = getModule(module);
+    if (threadCounters.exited) {
+      block = getOrphanBlock(state);
+    } else {
+      block = allocateBlock(*module);
+      state.liveBlocks.push_back(block);
+      threadCounters.blocks.push_back({&state, block, slot});
+    }
+  }
+  if (slot) {
+    *slot = block;
+  }
+  return block;
+}
+
+
+void
+CCOUNT(addLocal)(ModuleInfo* module, uint64_t id, uint64_t amount) {
+  uint64_t* block = nullptr;
+  if (!threadCounters.exited) {
+    for (auto& entry : threadCounters.blocks) {
+      if (!entry.module->retired && entry.module->info == module) {
+        block = entry.counters;
+        break;
+      }
+    }
+  }
+  if (!block) {
+    block = CCOUNT(registerThread)(module, nullptr);
+  }
+  __atomic_store_n(&block[id],
+                   __atomic_load_n(&block[id], __ATOMIC_RELAXED) + amount,
+                   __ATOMIC_RELAXED);
+}
+
+
+void
+CCOUNT(calledLocal)(ModuleInfo* module, uint64_t id) {
+  CCOUNT(addLocal)(module, id, 1);
+}
+
+
+// Pushes a call of function `id` onto the shadow stack of the thread and
+// returns its level, which the function passes back on its way out. The call
+// starts after the hook itself, so the hooks are only timed in the caller.
+uint64_t
+CCOUNT(timeEnter)(ModuleInfo* module, uint64_t id) {
+  auto& thread = threadTimings;
+  if (thread.exited) {
+    return NO_FRAME;
+  }
+
+  auto* block = thread.last;
+  if (!block || block->module->retired || block->module->info != module) {
+    block = nullptr;
+    for (auto* candidate : thread.blocks) {
+      if (!candidate->module->retired && candidate->module->info == module) {
+        block = candidate;
+        break;
+      }
+    }
+  }
+  if (!block) {
+    std::lock_guard<std::mutex> guard{registryLock};
+    auto& state      = getModule(module);
+    auto numCounters = module->numCounters;
+    block            = new TimingBlock{&state,
+                                       Timings(numCounters, state.timings.histograms),
+                                       std::vector<uint32_t>(numCounters)};
+    state.liveTimings.push_back(&block->timings);
+    thread.blocks.push_back(block);
+  }
+  thread.last = block;
+
+  ++block->active[id];
+  thread.stack.push_back({block, id, 0, 0});
+  auto level = thread.stack.size();
+  thread.stack.back().start = readCycles();
+  return level;
+}
+
+
+// Closes the call at `level` when a function returns, along with any calls
+// above it that never returned, e.g. after a longjmp.
+void
+CCOUNT(timeExit)(uint64_t level) {
+  auto end     = readCycles();
+  auto& thread = threadTimings;
+  while (!thread.exited && thread.stack.size() >= level) {
+    thread.close(end);
+  }
+}
+
+
+// Closes the calls above `level` when an exception lands in the function at
+// that level, since the exception unwound them.
+void
+CCOUNT(timeUnwind)(uint64_t level) {
+  auto end     = readCycles();
+  auto& thread = threadTimings;
+  while (!thread.exited && thread.stack.size() > level) {
+    thread.close(end);
+  }
+}
+
+
+// Reports the counts of all modules when the program exits. They are written
+// as a binary profile when CALLCOUNTER_PROFILE names a destination and printed
+// otherwise. Modules in continuous mode already have their own profiles.
+// Indirect call targets and timings are reported in text next to the profile.
+void
+CCOUNT(print)() {
+  std::lock_guard<std::mutex> guard{registryLock};
+  auto report = collectReport();
+
+  bool indirect = false;
+  bool timed    = false;
+  bool reported = false;
+  std::string reportPath;
+  for (auto* state : getModules()) {
+    indirect |= state->retired ? !state->indirectReport.empty()
+                               : 0 != state->info->numIndirectSites;
+    timed    |= 0 != state->timings.size();
+    if (-1 == state->continuousFile) {
+      reported = true;
+      continue;
+    }
+
+    // The counts are already in the profile. Only the flags may have changed.
+    if (isEstimated(*state)) {
+      uint32_t flags = callcounter::profile::FLAG_SAMPLED;
+      writeAll(state->continuousFile,
+               &flags,
+               sizeof(flags),
+               offsetof(callcounter::profile::Header, flags));
+    }
+    if (reportPath.empty()) {
+      reportPath = state->continuousPath;
+    }
+  }
+
+  auto* path = getenv("CALLCOUNTER_PROFILE");
+  if (reported && path && *path) {
+    reportPath = getNextProfilePath(path);
+    writeProfile(report, reportPath);
+  } else if (reported) {
+    printCounts(report);
+    reportPath.clear();
+  }
+
+  if (indirect && reportPath.empty()) {
+    printIndirectTargets(stdout);
+  } else if (indirect) {
+    writeIndirectReport(reportPath);
+  }
+
+  if (timed && reportPath.empty()) {
+    printTimings(stdout);
+  } else if (timed) {
+    writeTimingReport(reportPath);
+  }
+}
+
+
+// Records a call to `target` from indirect call site `site`. Each target
+// claims a free slot of the site with a compare and swap. Once all slots are
+// taken, other targets are counted as overflow, but a target may evict the
+// coldest slot when the overflow has outgrown it. The evicted count moves to
+// the overflow, so no calls are lost and frequent targets eventually hold the
+// slots.
+void
+CCOUNT(indirectCall)(ModuleInfo* module, uint64_t site, void* target) {
+  auto& entry  = module->indirectTargets[site];
+  auto address = reinterpret_cast<uintptr_t>(target);
+
+  for (unsigned slot = 0; slot < INDIRECT_TARGETS; ++slot) {
+    uintptr_t current = __atomic_load_n(&entry.targets[slot], __ATOMIC_RELAXED);
+    if (!current) {
+      __atomic_compare_exchange_n(&entry.targets[slot],
+                                  &current,
+                                  address,
+                                  false,
+                                  __ATOMIC_RELAXED,
+                                  __ATOMIC_RELAXED);
+      current = __atomic_load_n(&entry.targets[slot], __ATOMIC_RELAXED);
+    }
+    if (current == address) {
+      __atomic_fetch_add(&entry.counts[slot], 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+
+  uint64_t overflow = __atomic_add_fetch(&entry.overflow, 1, __ATOMIC_RELAXED);
+  unsigned coldest  = 0;
+  for (unsigned slot = 1; slot < INDIRECT_TARGETS; ++slot) {
+    if (__atomic_load_n(&entry.counts[slot], __ATOMIC_RELAXED)
+        < __atomic_load_n(&entry.counts[coldest], __ATOMIC_RELAXED)) {
+      coldest = slot;
+    }
+  }
+  uintptr_t victim = __atomic_load_n(&entry.targets[coldest], __ATOMIC_RELAXED);
+  if (overflow > 2 * __atomic_load_n(&entry.counts[coldest], __ATOMIC_RELAXED)
+      && __atomic_compare_exchange_n(&entry.targets[coldest],
+                                     &victim,
+                                     address,
+                                     false,
+                                     __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED)) {
+    // This call moves from the overflow to the newly claimed slot.
+    uint64_t evicted = __atomic_exchange_n(&entry.counts[coldest], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&entry.overflow, evicted - 1, __ATOMIC_RELAXED);
+  }
+}
+
+
+// Starts sampling for all modules. They share the sampling state, so the
+// first module to start sampling chooses the mode and period.
+void
+CCOUNT(startSampling)(uint32_t mode, uint64_t period) {
+  if (samplingStarted.exchange(true)) {
+    return;
+  }
+  samplingMode  = mode;
+  samplingStart = Clock::now();
+  if (WINDOW != mode) {
+    return;
+  }
+
+  if (period <= 1) {
+    // The windows would never close.
+    __atomic_store_n(&CCOUNT(sampleEnabled), 1, __ATOMIC_RELAXED);
+    samplingMode = NO_SAMPLING;
+    return;
+  }
+  std::thread(runSampleWindows, period).detach();
+}
+
+
+// Records the samples taken once the countdown of the thread has expired.
+// Each sample stands for `period` events of the function that expired it.
+void
+CCOUNT(sampleHit)(ModuleInfo* module, uint64_t id, uint64_t period) {
+  int64_t remaining = CCOUNT(sampleCountdown);
+  if (!countdownStarted) {
+    // The first events of a thread are not always sampled.
+    countdownStarted = true;
+    remaining += nextInterval(period);
+  }
+
+  uint64_t samples = 0;
+  if (remaining < 0) {
+    // Batched updates may pass several periods at once.
+    uint64_t skipped = static_cast<uint64_t>(-remaining) / period;
+    samples += skipped;
+    remaining += skipped * period;
+  }
+  while (remaining <= 0) {
+    ++samples;
+    remaining += nextInterval(period);
+  }
+  CCOUNT(sampleCountdown) = remaining;
+
+  if (samples) {
+    __atomic_fetch_add(
+        &module->counters[id], samples * period, __ATOMIC_RELAXED);
   }
 }
 }
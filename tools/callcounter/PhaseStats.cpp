@@ -0,0 +1,122 @@
+
+
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+
+#include <sys/resource.h>
+
+#include "PhaseStats.h"
+
+
+using namespace llvm;
+using callcounter::PhaseStats;
+using callcounter::PhaseTimer;
+
+
+// Returns the user and system time so far, over all threads and including
+// the programs that were run and waited for, such as the linker, along with
+// the peak resident memory of the process.
+static std::pair<double, uint64_t>
+getUsage() {
+  rusage self;
+  rusage children;
+  if (0 != getrusage(RUSAGE_SELF, &self) || 0 != getrusage(RUSAGE_CHILDREN, &children)) {
+    return {0, 0};
+  }
+  auto toSeconds = [](const timeval& time) {
+    return time.tv_sec + time.tv_usec / 1e6;
+  };
+  double cpu = toSeconds(self.ru_utime) + toSeconds(self.ru_stime)
+               + toSeconds(children.ru_utime) + toSeconds(children.ru_stime);
+  return {cpu, static_cast<uint64_t>(self.ru_maxrss) / 1024};
+}
+
+
+PhaseTimer::PhaseTimer(PhaseStats& stats, StringRef name)
+  : stats{stats},
+    name{name.str()} {
+  if (stats.enabled) {
+    wallStart = std::chrono::steady_clock::now();
+    cpuStart  = getUsage().first;
+  }
+}
+
+
+PhaseTimer::~PhaseTimer() {
+  if (!stats.enabled) {
+    return;
+  }
+  std::chrono::duration<double> wall = std::chrono::steady_clock::now() - wallStart;
+  auto [cpu, peakMiB] = getUsage();
+  stats.phases.push_back({name, wall.count(), cpu - cpuStart, peakMiB});
+}
+
+
+void
+PhaseStats::addModule(StringRef name, const Module& m) {
+  if (!enabled) {
+    return;
+  }
+  ModuleRecord record{name.str()};
+  for (auto& f : m) {
+    record.functions += !f.isDeclaration();
+    for (auto& bb : f) {
+      for (auto& i : bb) {
+        ++record.instructions;
+        record.callSites += isa<CallBase>(i);
+      }
+    }
+  }
+  modules.push_back(std::move(record));
+}
+
+
+void
+PhaseStats::print(raw_ostream& out) const {
+  out << "Phase Statistics\n"
+      << "================\n";
+  for (auto& phase : phases) {
+    out << phase.name << " : " << format("%.3f", phase.wallSeconds) << "s wall, "
+        << format("%.3f", phase.cpuSeconds) << "s CPU, " << phase.peakMiB
+        << " MiB peak\n";
+  }
+  for (auto& module : modules) {
+    out << "Module " << module.name << " : " << module.functions << " functions, "
+        << module.instructions << " instructions, " << module.callSites
+        << " call sites\n";
+  }
+  if (numCounters) {
+    out << "Counters : " << numCounters << "\n";
+  }
+}
+
+
+void
+PhaseStats::printJSON(raw_ostream& out) const {
+  json::OStream json{out, 2};
+  json.object([&] {
+    json.attributeArray("phases", [&] {
+      for (auto& phase : phases) {
+        json.object([&] {
+          json.attribute("name", phase.name);
+          json.attribute("wallSeconds", phase.wallSeconds);
+          json.attribute("cpuSeconds", phase.cpuSeconds);
+          json.attribute("peakMiB", phase.peakMiB);
+        });
+      }
+    });
+    json.attributeArray("modules", [&] {
+      for (auto& module : modules) {
+        json.object([&] {
+          json.attribute("name", module.name);
+          json.attribute("functions", module.functions);
+          json.attribute("instructions", module.instructions);
+          json.attribute("callSites", module.callSites);
+        });
+      }
+    });
+    json.attribute("counters", numCounters);
+  });
+  out << "\n";
+}
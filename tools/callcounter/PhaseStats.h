@@ -0,0 +1,73 @@
+
+
+#ifndef PHASESTATS_H
+#define PHASESTATS_H
+
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+
+namespace callcounter {
+
+
+// The cost of one phase of a run, such as loading, instrumenting, or
+// compiling a module. The peak memory is that of the process by the end of
+// the phase.
+struct PhaseRecord {
+  std::string name;
+  double wallSeconds = 0;
+  double cpuSeconds  = 0;
+  uint64_t peakMiB   = 0;
+};
+
+
+// The size of a module at some point of a run.
+struct ModuleRecord {
+  std::string name;
+  uint64_t functions    = 0;
+  uint64_t instructions = 0;
+  uint64_t callSites    = 0;
+};
+
+
+// Measures where a run of the tool spends its time and memory. Nothing is
+// recorded unless `enabled` is set, so the phases can be marked throughout.
+struct PhaseStats {
+  bool enabled = false;
+  std::vector<PhaseRecord> phases;
+  std::vector<ModuleRecord> modules;
+  // The counters inserted by instrumenting, including edge counters.
+  uint64_t numCounters = 0;
+
+  void addModule(llvm::StringRef name, const llvm::Module& m);
+
+  void print(llvm::raw_ostream& out) const;
+  void printJSON(llvm::raw_ostream& out) const;
+};
+
+
+// Records a phase from its construction to its destruction.
+struct PhaseTimer {
+  PhaseStats& stats;
+  std::string name;
+  std::chrono::steady_clock::time_point wallStart;
+  double cpuStart = 0;
+
+  PhaseTimer(PhaseStats& stats, llvm::StringRef name);
+  ~PhaseTimer();
+
+  PhaseTimer(const PhaseTimer&) = delete;
+  PhaseTimer& operator=(const PhaseTimer&) = delete;
+};
+
+
+}  // namespace callcounter
+
+
+#endif
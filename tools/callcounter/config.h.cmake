@@ -5,4 +5,13 @@
 #define RUNTIME_LIB "callcounter-rt"
 #cmakedefine CMAKE_TEMP_LIBRARY_PATH "@CMAKE_TEMP_LIBRARY_PATH@"
 
+// Linking in process with lld needs the startup files, libraries, and dynamic
+// linker that the C++ compiler driver would otherwise add.
+#cmakedefine CALLCOUNTER_HAVE_LLD
+#define CALLCOUNTER_DYNAMIC_LINKER "@CALLCOUNTER_DYNAMIC_LINKER@"
+#define CALLCOUNTER_LINK_START_FILES @CALLCOUNTER_LINK_START_FILES@
+#define CALLCOUNTER_LINK_END_FILES @CALLCOUNTER_LINK_END_FILES@
+#define CALLCOUNTER_IMPLICIT_LINK_DIRS @CALLCOUNTER_IMPLICIT_LINK_DIRS@
+#define CALLCOUNTER_IMPLICIT_LINK_LIBS @CALLCOUNTER_IMPLICIT_LINK_LIBS@
+
 #endif
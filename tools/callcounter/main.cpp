@@ -1,11 +1,19 @@
 
+#include "llvm/ADT/ScopeExit.h"
 #include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/AsmParser/Parser.h"
+#include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/CodeGen/CommandFlags.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/CodeGen/LinkAllAsmWriterComponents.h"
 #include "llvm/CodeGen/LinkAllCodegenComponents.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/TargetProcess/TargetExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/IRPrintingPasses.h"
 #include "llvm/IR/LLVMContext.h"
@@ -17,17 +25,25 @@
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Pass.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CachePruning.h"
 #include "llvm/Support/CodeGen.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/MD5.h"
 #include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Parallel.h"
 #include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Process.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/Program.h"
 #include "llvm/Support/Signals.h"
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Threading.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
@@ -35,15 +51,39 @@
 #include "llvm/TargetParser/SubtargetFeature.h"
 #include "llvm/TargetParser/Triple.h"
 #include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
 #include <string>
+#include <thread>
 
+#include <sys/resource.h>
+
+#include "CallProfileAnnotator.h"
 #include "DynamicCallCounter.h"
+#include "PhaseStats.h"
+#include "ProfileReader.h"
 #include "StaticCallCounter.h"
+#include "StaticCallEstimator.h"
 
 #include "config.h"
 
+#ifdef CALLCOUNTER_HAVE_LLD
+#include "lld/Common/Driver.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+LLD_HAS_DRIVER(elf)
+#endif
+
 using namespace llvm;
 using std::string;
 using std::unique_ptr;
@@ -51,22 +91,34 @@ using std::vector;
 using llvm::sys::ExecuteAndWait;
 using llvm::sys::findProgramByName;
 using llvm::legacy::PassManager;
+using callcounter::ProfileFile;
+
+
+enum class StatsFormat {
+  NONE,
+  TEXT,
+  JSON,
+};
 
 
 enum class AnalysisType {
   STATIC,
   DYNAMIC,
+  TIMING,
+  ESTIMATE,
+  OPTIMIZE,
+  MERGE,
+  WATCH,
 };
 
 
 static cl::OptionCategory callCounterCategory{"call counter options"};
 
-static cl::opt<string> inPath{cl::Positional,
-                              cl::desc{"<Module to analyze>"},
-                              cl::value_desc{"bitcode filename"},
-                              cl::init(""),
-                              cl::Required,
-                              cl::cat{callCounterCategory}};
+static cl::list<string> inPaths{cl::Positional,
+                                cl::desc{"<Module to analyze or profiles to merge>"},
+                                cl::value_desc{"filename"},
+                                cl::OneOrMore,
+                                cl::cat{callCounterCategory}};
 
 static cl::opt<AnalysisType> analysisType{
     cl::desc{"Select analyis type:"},
@@ -75,17 +127,280 @@ static cl::opt<AnalysisType> analysisType{
                           "Count static direct calls."),
                clEnumValN(AnalysisType::DYNAMIC,
                           "dynamic",
-                          "Count dynamic direct calls.")
+                          "Count dynamic direct calls."),
+               clEnumValN(AnalysisType::TIMING,
+                          "timing",
+                          "Count dynamic direct calls and time each function."),
+               clEnumValN(AnalysisType::ESTIMATE,
+                          "estimate",
+                          "Estimate dynamic direct calls from block frequencies."),
+               clEnumValN(AnalysisType::OPTIMIZE,
+                          "optimize",
+                          "Optimize and compile a program for its measured calls."),
+               clEnumValN(AnalysisType::MERGE,
+                          "merge",
+                          "Merge binary profiles and report the hottest calls."),
+               clEnumValN(AnalysisType::WATCH,
+                          "watch",
+                          "Report the call rates of a live continuous profile.")
                ),
     cl::Required,
     cl::cat{callCounterCategory}};
 
+static cl::opt<callcounter::CounterUpdate> counterUpdate{
+    "counter-update",
+    cl::desc{"Select how dynamic counters are updated:"},
+    cl::values(clEnumValN(callcounter::CounterUpdate::INLINE,
+                          "inline",
+                          "Increment counters directly in the IR (default)."),
+               clEnumValN(callcounter::CounterUpdate::CALL,
+                          "call",
+                          "Call into the runtime library for each event.")
+               ),
+    cl::init(callcounter::CounterUpdate::INLINE),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<callcounter::CounterMode> counterMode{
+    "counter-mode",
+    cl::desc{"Select how dynamic counters handle multiple threads:"},
+    cl::values(clEnumValN(callcounter::CounterMode::PLAIN,
+                          "plain",
+                          "Shared counters without synchronization (default)."),
+               clEnumValN(callcounter::CounterMode::ATOMIC,
+                          "atomic",
+                          "Shared counters with relaxed atomic updates."),
+               clEnumValN(callcounter::CounterMode::THREAD_LOCAL,
+                          "thread-local",
+                          "Per thread counters summed when threads exit.")
+               ),
+    cl::init(callcounter::CounterMode::PLAIN),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<bool> coalesceCounters{
+    "coalesce-counters",
+    cl::desc{"Merge the counter updates for a function within a block"},
+    cl::init(false),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<bool> promoteLoopCounters{
+    "promote-loop-counters",
+    cl::desc{"Keep counts in registers within loops and update the counters "
+             "on loop exits"},
+    cl::init(false),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<callcounter::SamplingMode> samplingMode{
+    "sampling",
+    cl::desc{"Select whether to count only a sample of the events:"},
+    cl::values(clEnumValN(callcounter::SamplingMode::NONE,
+                          "none",
+                          "Count every event (default)."),
+               clEnumValN(callcounter::SamplingMode::COUNTDOWN,
+                          "countdown",
+                          "Count one in every -sample-period events."),
+               clEnumValN(callcounter::SamplingMode::WINDOW,
+                          "window",
+                          "Count during 1ms windows every -sample-period ms.")
+               ),
+    cl::init(callcounter::SamplingMode::NONE),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<uint64_t> samplePeriod{
+    "sample-period",
+    cl::desc{"Events (countdown) or milliseconds (window) between samples"},
+    cl::value_desc{"N"},
+    cl::init(1000),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<bool> profileIndirect{
+    "profile-indirect",
+    cl::desc{"Record the targets of indirect calls at each call site"},
+    cl::init(false),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<bool> continuousMode{
+    "continuous",
+    cl::desc{"Keep the counters in the profile file while the program runs"},
+    cl::init(false),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<double> watchInterval{
+    "interval",
+    cl::desc{"Seconds between the snapshots of a watched profile"},
+    cl::init(1.0),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<unsigned> watchReports{
+    "reports",
+    cl::desc{"Number of rate reports when watching (0 = until interrupted)"},
+    cl::init(0),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<bool> countEdges{
+    "count-edges",
+    cl::desc{"Count direct calls per caller and callee pair"},
+    cl::init(false),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<bool> latencyHistograms{
+    "latency-histograms",
+    cl::desc{"Keep a log2 histogram of the call latencies of each function "
+             "when timing"},
+    cl::init(false),
+    cl::cat{callCounterCategory}};
+
+static cl::list<string> allowPatterns{
+    "allow",
+    cl::desc{"Only count functions whose names match one of these globs"},
+    cl::value_desc{"glob"},
+    cl::CommaSeparated,
+    cl::cat{callCounterCategory}};
+
+static cl::list<string> denyPatterns{
+    "deny",
+    cl::desc{"Do not count functions whose names match any of these globs"},
+    cl::value_desc{"glob"},
+    cl::CommaSeparated,
+    cl::cat{callCounterCategory}};
+
+static cl::list<string> selectionProfiles{
+    "selection-profile",
+    cl::desc{"Profiles of earlier runs for -max-calls"},
+    cl::value_desc{"filename"},
+    cl::cat{callCounterCategory}};
+
+static cl::opt<uint64_t> maxCalls{
+    "max-calls",
+    cl::desc{"Do not count functions with more calls in -selection-profile"},
+    cl::value_desc{"N"},
+    cl::init(0),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<unsigned> minInstructions{
+    "min-instructions",
+    cl::desc{"Do not count functions with fewer IR instructions"},
+    cl::value_desc{"N"},
+    cl::init(0),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<bool> batchMode{
+    "batch",
+    cl::desc{"Instrument each input as a separate program, in parallel"},
+    cl::init(false),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<bool> runInProcess{
+    "run",
+    cl::desc{"Run the instrumented module in process instead of building a "
+             "program. Arguments after -- are passed to its main"},
+    cl::init(false),
+    cl::cat{callCounterCategory}};
+
 static cl::opt<string> outFile{"o",
-                               cl::desc{"Filename of the instrumented program"},
+                               cl::desc{"Filename of the instrumented program or "
+                                        "object, or the output directory in "
+                                        "batch mode"},
                                cl::value_desc{"filename"},
                                cl::init(""),
                                cl::cat{callCounterCategory}};
 
+static cl::opt<bool> compileOnly{
+    "c",
+    cl::desc{"Write the instrumented object file instead of linking a program"},
+    cl::init(false),
+    cl::cat{callCounterCategory}};
+
+static cl::alias emitObject{"emit-object",
+                            cl::desc{"Alias for -c"},
+                            cl::aliasopt{compileOnly},
+                            cl::cat{callCounterCategory}};
+
+static cl::opt<unsigned> topCount{
+    "top",
+    cl::desc{"Number of functions to report when merging profiles, or the "
+             "hottest functions to compare with -compare-profile"},
+    cl::value_desc{"N"},
+    cl::init(20),
+    cl::cat{callCounterCategory}};
+
+static cl::list<string> compareProfiles{
+    "compare-profile",
+    cl::desc{"Profiles to compare the estimated calls against"},
+    cl::value_desc{"filename"},
+    cl::cat{callCounterCategory}};
+
+static cl::list<string> profileUse{
+    "profile-use",
+    cl::desc{"Profiles whose calls guide -optimize"},
+    cl::value_desc{"filename"},
+    cl::cat{callCounterCategory}};
+
+static cl::opt<bool> lazyLoad{
+    "lazy",
+    cl::desc{"Load one function body at a time when counting static calls"},
+    cl::init(false),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<string> staticCache{
+    "static-cache",
+    cl::desc{"Directory of static reports reused while the input is unchanged"},
+    cl::value_desc{"directory"},
+    cl::init(""),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<string> buildCache{
+    "build-cache",
+    cl::desc{"Directory of built programs reused while the input and options "
+             "are unchanged"},
+    cl::value_desc{"directory"},
+    cl::init(""),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<string> buildCachePolicy{
+    "build-cache-policy",
+    cl::desc{"Pruning policy of -build-cache, e.g. "
+             "'cache_size_bytes=1g:prune_after=72h'"},
+    cl::value_desc{"policy"},
+    cl::init(""),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<unsigned> numJobs{
+    "j",
+    cl::desc{"Number of threads for static counting, merging, and batch "
+             "instrumentation (0 = all)"},
+    cl::value_desc{"N"},
+    cl::init(0),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<unsigned> codegenPartitions{
+    "codegen-partitions",
+    cl::desc{"Split the instrumented module to generate code in parallel"},
+    cl::value_desc{"N"},
+    cl::init(1),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<bool> externalLinker{
+    "external-linker",
+    cl::desc{"Link with the clang++ driver even when lld is built in"},
+    cl::init(false),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<string> prePasses{
+    "pre-passes",
+    cl::desc{"Optimization pipeline to run before instrumenting, "
+             "e.g. 'default<O2>'"},
+    cl::value_desc{"pipeline"},
+    cl::init(""),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<string> postPasses{
+    "post-passes",
+    cl::desc{"Optimization pipeline to run after instrumenting, "
+             "e.g. 'function(instcombine,simplifycfg)'"},
+    cl::value_desc{"pipeline"},
+    cl::init(""),
+    cl::cat{callCounterCategory}};
+
 static cl::opt<char> optLevel{
     "O",
     cl::desc{"Optimization level. [-O0, -O1, -O2, or -O3] (default = '-O2')"},
@@ -94,6 +409,21 @@ static cl::opt<char> optLevel{
     cl::init('2'),
     cl::cat{callCounterCategory}};
 
+static cl::opt<StatsFormat> phaseStatsFormat{
+    "phase-stats",
+    cl::desc{"Report the time and memory of each phase of the run:"},
+    cl::values(clEnumValN(StatsFormat::TEXT, "text", "As readable text."),
+               clEnumValN(StatsFormat::JSON, "json", "As JSON.")),
+    cl::init(StatsFormat::NONE),
+    cl::cat{callCounterCategory}};
+
+static cl::opt<string> phaseStatsFile{
+    "phase-stats-file",
+    cl::desc{"File to write the -phase-stats report to instead of stderr"},
+    cl::value_desc{"filename"},
+    cl::init(""),
+    cl::cat{callCounterCategory}};
+
 static cl::list<string> libPaths{"L",
                                  cl::Prefix,
                                  cl::desc{"Specify a library search path"},
@@ -106,24 +436,51 @@ static cl::list<string> libraries{"l",
                                   cl::value_desc{"library prefix"},
                                   cl::cat{callCounterCategory}};
 
+// Timing instruments programs like dynamic counting, with additional hooks.
+static bool
+isInstrumenting() {
+  return AnalysisType::DYNAMIC == analysisType || AnalysisType::TIMING == analysisType;
+}
+
+
 // Make sure that compilation options are enabled when the program loads.
 static codegen::RegisterCodeGenFlags cfg;
 
+// Batch mode compiles and links several programs at once, so progress is
+// reported a whole line at a time.
+static std::mutex outputLock;
+
+static callcounter::PhaseStats phaseStats;
+
 
 static void
-compile(Module& m, std::string_view outputPath) {
-  string err;
+printLine(const Twine& line) {
+  std::lock_guard<std::mutex> guard{outputLock};
+  outs() << line << "\n";
+  outs().flush();
+}
+
 
-  Triple triple        = Triple(m.getTargetTriple());
+// Failures while building one program are returned as errors, so that batch
+// mode can report them for that input and go on with the others.
+static Error
+makeError(const Twine& message) {
+  return createStringError(inconvertibleErrorCode(), message);
+}
+
+
+static Expected<unique_ptr<TargetMachine>>
+createTargetMachine(Triple triple) {
+  string err;
   Target const* target = TargetRegistry::lookupTarget(codegen::getMArch(), triple, err);
   if (!target) {
-    report_fatal_error(Twine{"Unable to find target:\n " + err});
+    return makeError("Unable to find target:\n " + err);
   }
 
   CodeGenOptLevel level = CodeGenOptLevel::Default;
   switch (optLevel) {
     default:
-      report_fatal_error("Invalid optimization level.\n");
+      return makeError("Invalid optimization level.");
     // No fall through
     case '0': level = CodeGenOptLevel::None; break;
     case '1': level = CodeGenOptLevel::Less; break;
@@ -153,11 +510,17 @@ compile(Module& m, std::string_view outputPath) {
   if (auto floatABI = codegen::getFloatABIForCalls(); floatABI != FloatABI::Default) {
     options.FloatABIType = floatABI;
   }
+  return machine;
+}
 
-  std::error_code errc;
-  auto out = std::make_unique<ToolOutputFile>(outputPath, errc, sys::fs::OF_None);
-  if (errc) {
-    report_fatal_error(Twine{"Unable to create file:\n " + errc.message()});
+
+// Generates the object code for the module into memory.
+static Expected<SmallVector<char, 0>>
+compile(Module& m) {
+  Triple triple = Triple(m.getTargetTriple());
+  auto machine  = createTargetMachine(triple);
+  if (!machine) {
+    return machine.takeError();
   }
 
   // Build up all of the passes that we want to do to the module.
@@ -167,44 +530,417 @@ compile(Module& m, std::string_view outputPath) {
   TargetLibraryInfoImpl tlii(triple);
   pm.add(new TargetLibraryInfoWrapperPass(tlii));
 
-  m.setDataLayout(machine->createDataLayout());
+  m.setDataLayout((*machine)->createDataLayout());
+
+  SmallVector<char, 0> object;
+  raw_svector_ostream os(object);
+
+  // Ask the target to add backend passes as necessary.
+  if ((*machine)->addPassesToEmitFile(pm, os, nullptr, CodeGenFileType::ObjectFile)) {
+    return makeError("target does not support generation of this file type!");
+  }
+
+  // Before executing passes, print the final values of the LLVM options.
+  cl::PrintOptionValues();
+
+  pm.run(m);
+  return object;
+}
+
+
+static Error
+writeObjectFile(ArrayRef<char> object, const string& path) {
+  std::error_code errc;
+  ToolOutputFile out(path, errc, sys::fs::OF_None);
+  if (errc) {
+    return makeError("Unable to create file " + path + ":\n " + errc.message());
+  }
+  out.os().write(object.data(), object.size());
+  out.os().close();
+  if (out.os().has_error()) {
+    errc = out.os().error();
+    out.os().clear_error();
+    return makeError("Unable to write file " + path + ":\n " + errc.message());
+  }
+  out.keep();
+  return Error::success();
+}
 
-  {  // Bound this scope
-    raw_pwrite_stream* os(&out->os());
 
-    std::unique_ptr<buffer_ostream> bos;
-    if (!out->os().supportsSeeking()) {
-      bos = std::make_unique<buffer_ostream>(*os);
-      os  = bos.get();
+// Changing how programs are instrumented or built must change this, so that
+// stale entries are not reused.
+static constexpr StringLiteral BUILD_CACHE_VERSION = "callcounter-build-1";
+
+
+// Describes everything besides the input that a built program depends on:
+// the tool itself along with the runtime built with it, the mode, and the
+// options of instrumenting, optimizing, code generation, and linking.
+// Profiles are described by their contents. Other LLVM options are not.
+static const string&
+getBuildConfiguration(StringRef invocationPath) {
+  static const string configuration = [invocationPath] {
+    string configuration;
+    raw_string_ostream out{configuration};
+
+    // Every value ends with a NUL, so that adjacent values never run together.
+    auto add = [&out](const auto& value) { out << value << '\0'; };
+    auto addAll = [&add](ArrayRef<string> values) {
+      add(values.size());
+      for (auto& value : values) {
+        add(value);
+      }
+    };
+    auto addContents = [&add](ArrayRef<string> paths) {
+      add(paths.size());
+      for (auto& path : paths) {
+        auto buffer = MemoryBuffer::getFile(path);
+        add(buffer ? (*buffer)->getBuffer() : StringRef{path});
+      }
+    };
+
+    auto toolPath = sys::fs::getMainExecutable(invocationPath.str().c_str(),
+                                               (void*)&getBuildConfiguration);
+    sys::fs::file_status tool;
+    if (sys::fs::status(toolPath, tool)) {
+      add(toolPath);
+    } else {
+      add(tool.getSize());
+      add(tool.getLastModificationTime().time_since_epoch().count());
     }
+    add(BUILD_CACHE_VERSION);
+    add(LLVM_VERSION_STRING);
+
+    add(static_cast<int>(analysisType.getValue()));
+    add(static_cast<int>(counterUpdate.getValue()));
+    add(static_cast<int>(counterMode.getValue()));
+    add(static_cast<int>(coalesceCounters));
+    add(static_cast<int>(promoteLoopCounters));
+    add(static_cast<int>(samplingMode.getValue()));
+    add(samplePeriod.getValue());
+    add(static_cast<int>(profileIndirect));
+    add(static_cast<int>(countEdges));
+    add(static_cast<int>(continuousMode));
+    add(static_cast<int>(latencyHistograms));
+    addAll(allowPatterns);
+    addAll(denyPatterns);
+    addContents(selectionProfiles);
+    add(maxCalls.getValue());
+    add(minInstructions.getValue());
+    addContents(profileUse);
+    add(prePasses.getValue());
+    add(postPasses.getValue());
+
+    auto relocationModel = codegen::getExplicitRelocModel();
+    auto codeModel       = codegen::getExplicitCodeModel();
+    add(optLevel.getValue());
+    add(codegen::getMArch());
+    add(codegen::getCPUStr());
+    add(codegen::getFeaturesStr());
+    add(relocationModel ? static_cast<int>(*relocationModel) : -1);
+    add(codeModel ? static_cast<int>(*codeModel) : -1);
+    add(static_cast<int>(codegen::getFloatABIForCalls()));
+    add(codegenPartitions.getValue());
+    add(static_cast<int>(compileOnly));
+    add(static_cast<int>(externalLinker));
+    addAll(libPaths);
+    addAll(libraries);
+
+    out.flush();
+    return configuration;
+  }();
+  return configuration;
+}
+
 
-    // Ask the target to add backend passes as necessary.
-    if (machine->addPassesToEmitFile(pm, *os, nullptr, CodeGenFileType::ObjectFile)) {
-      report_fatal_error("target does not support generation "
-                         "of this file type!\n");
+// Entries are content addressed, keyed by a hash of the configuration and the
+// input, and named so that LLVM's cache pruning manages them.
+static string
+getBuildCachePath(StringRef inPath, StringRef invocationPath) {
+  if (buildCache.empty()) {
+    return "";
+  }
+  auto& configuration = getBuildConfiguration(invocationPath);
+  auto buffer         = MemoryBuffer::getFile(inPath);
+  if (!buffer) {
+    return "";
+  }
+
+  MD5 hash;
+  hash.update(configuration);
+  hash.update((*buffer)->getBuffer());
+  MD5::MD5Result result;
+  hash.final(result);
+
+  SmallString<128> path{buildCache.getValue()};
+  sys::path::append(path, Twine{"llvmcache-"} + result.digest());
+  return path.str().str();
+}
+
+
+// Instrumented programs are cached along with their instrumented modules.
+static string
+getCachedModulePath(StringRef entry) {
+  return (entry + ".callcounter.bc").str();
+}
+
+
+// Marks a cache entry as used, so that pruning by age keeps it even where
+// access times are not updated by reading.
+static void
+touchCacheEntry(StringRef path) {
+  int fd = -1;
+  if (!sys::fs::openFileForWrite(path, fd, sys::fs::CD_OpenExisting, sys::fs::OF_Append)) {
+    sys::fs::setLastAccessAndModificationTime(fd, std::chrono::system_clock::now());
+    sys::Process::SafelyCloseFileDescriptor(fd);
+  }
+}
+
+
+static std::error_code
+copyExecutable(StringRef from, StringRef to) {
+  auto errc = sys::fs::copy_file(from, to);
+  if (auto permissions = sys::fs::getPermissions(from); !errc && permissions) {
+    errc = sys::fs::setPermissions(to, *permissions);
+  }
+  return errc;
+}
+
+
+// Copies a cached program, and its instrumented module when instrumenting, to
+// `outPath`. Returns false when the entry is missing or incomplete.
+static bool
+restoreFromBuildCache(StringRef entry, StringRef outPath) {
+  if (entry.empty()) {
+    return false;
+  }
+  callcounter::PhaseTimer timer{phaseStats, "cache"};
+  SmallVector<std::pair<string, string>, 2> files{{entry.str(), outPath.str()}};
+  if (isInstrumenting()) {
+    files.push_back({getCachedModulePath(entry), (outPath + ".callcounter.bc").str()});
+  }
+
+  for (auto& [cached, restored] : files) {
+    if (!sys::fs::exists(cached)) {
+      return false;
+    }
+  }
+  for (auto& [cached, restored] : files) {
+    if (copyExecutable(cached, restored)) {
+      return false;
     }
+    touchCacheEntry(cached);
+  }
+  return true;
+}
 
-    // Before executing passes, print the final values of the LLVM options.
-    cl::PrintOptionValues();
 
-    pm.run(m);
+// Writes an entry into the cache through a temporary file, so that concurrent
+// builds never read a partial entry. Failures only cost the reuse.
+static void
+storeCacheEntry(StringRef entry, function_ref<std::error_code(StringRef)> write) {
+  int fd = -1;
+  SmallString<128> tempPath;
+  auto errc = sys::fs::create_directories(sys::path::parent_path(entry));
+  if (!errc) {
+    errc = sys::fs::createUniqueFile(entry + ".tmp%%%%%%", fd, tempPath);
   }
+  if (!errc) {
+    sys::Process::SafelyCloseFileDescriptor(fd);
+    errc = write(tempPath);
+  }
+  if (!errc) {
+    errc = sys::fs::rename(tempPath, entry);
+  }
+  if (errc) {
+    errs() << "Warning: unable to update the build cache: " << errc.message() << "\n";
+    if (!tempPath.empty()) {
+      sys::fs::remove(tempPath);
+    }
+  }
+}
+
 
-  // Keep the output binary if we've been successful to this point.
-  out->keep();
+static void
+storeCacheFile(StringRef from, StringRef entry) {
+  storeCacheEntry(entry, [from](StringRef tempPath) {
+    return copyExecutable(from, tempPath);
+  });
+}
+
+
+static void
+storeInBuildCache(StringRef entry, StringRef outPath) {
+  if (entry.empty()) {
+    return;
+  }
+  callcounter::PhaseTimer timer{phaseStats, "cache"};
+  if (isInstrumenting()) {
+    storeCacheFile((outPath + ".callcounter.bc").str(), getCachedModulePath(entry));
+  }
+  storeCacheFile(outPath, entry);
+}
+
+
+// Partitions of the instrumented module are cached by their bitcode, so that
+// rebuilding an input after editing some of its functions only compiles the
+// partitions that changed. Counters are numbered in the order of the module,
+// so edits that add or remove counted calls also change the partitions that
+// use the counters after them.
+static string
+getPartitionCachePath(ArrayRef<char> bitcode) {
+  if (buildCache.empty()) {
+    return "";
+  }
+
+  // The configuration was described when the entry of the input was found.
+  MD5 hash;
+  hash.update(getBuildConfiguration(""));
+  hash.update("partition");
+  hash.update(StringRef{bitcode.data(), bitcode.size()});
+  MD5::MD5Result result;
+  hash.final(result);
+
+  SmallString<128> path{buildCache.getValue()};
+  sys::path::append(path, Twine{"llvmcache-"} + result.digest());
+  return path.str().str();
+}
+
+
+static bool
+restoreCachedObject(StringRef entry, SmallVector<char, 0>& object) {
+  if (entry.empty()) {
+    return false;
+  }
+  auto buffer = MemoryBuffer::getFile(entry);
+  if (!buffer) {
+    return false;
+  }
+  object.assign((*buffer)->getBufferStart(), (*buffer)->getBufferEnd());
+  touchCacheEntry(entry);
+  return true;
+}
+
+
+static void
+storeCachedObject(StringRef entry, ArrayRef<char> object) {
+  if (entry.empty()) {
+    return;
+  }
+  storeCacheEntry(entry, [object](StringRef tempPath) {
+    std::error_code errc;
+    raw_fd_ostream out(tempPath, errc, sys::fs::OF_None);
+    if (!errc) {
+      out.write(object.data(), object.size());
+      out.close();
+      errc = out.error();
+      out.clear_error();
+    }
+    return errc;
+  });
 }
 
 
+// Splitting externalizes local symbols under their own names, such as the
+// counter tables of the module, so they are suffixed with an ID of the module
+// first, as ThinLTO does when promoting locals. Otherwise separately
+// partitioned modules would define the same hidden symbols.
 static void
-link(std::string_view objectFile, std::string_view outputFile) {
+renameLocals(Module& m) {
+  auto suffix = getUniqueModuleId(&m);
+  if (suffix.empty()) {
+    // Without strong external definitions, the module is told apart by name.
+    MD5 hash;
+    hash.update(m.getSourceFileName());
+    hash.update(m.getModuleIdentifier());
+    MD5::MD5Result result;
+    hash.final(result);
+    suffix = ("." + result.digest()).str();
+  }
+
+  for (auto& gv : m.global_values()) {
+    if (gv.hasLocalLinkage()) {
+      gv.setName((gv.hasName() ? gv.getName() : "callcounter.unnamed") + suffix);
+    }
+  }
+}
+
+
+// Splits the module and compiles the partitions concurrently, each in its own
+// context, like the parallel LTO backends. Local symbols are externalized with
+// hidden visibility, so the partitions link back together. Partitions that
+// were compiled before are reused from the build cache.
+static Expected<vector<SmallVector<char, 0>>>
+compileInPartitions(Module& m) {
+  renameLocals(m);
+
+  vector<SmallVector<char, 0>> partitions;
+  SplitModule(m, codegenPartitions, [&](unique_ptr<Module> partition) {
+    partitions.emplace_back();
+    raw_svector_ostream out(partitions.back());
+    WriteBitcodeToFile(*partition, out);
+  });
+
+  vector<SmallVector<char, 0>> objects(partitions.size());
+  vector<double> seconds(partitions.size());
+  vector<uint8_t> cached(partitions.size());
+  Error errors = Error::success();
+  std::mutex errorsLock;
+  parallelFor(0, partitions.size(), [&](size_t i) {
+    auto start = std::chrono::steady_clock::now();
+
+    auto entry = getPartitionCachePath(partitions[i]);
+    cached[i]  = restoreCachedObject(entry, objects[i]);
+    if (cached[i]) {
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      seconds[i] = elapsed.count();
+      return;
+    }
+
+    LLVMContext context;
+    StringRef bitcode{partitions[i].data(), partitions[i].size()};
+    auto object = [&]() -> Expected<SmallVector<char, 0>> {
+      auto partition = parseBitcodeFile(MemoryBufferRef{bitcode, "partition"}, context);
+      if (!partition) {
+        return partition.takeError();
+      }
+      return compile(**partition);
+    }();
+    if (object) {
+      objects[i] = std::move(*object);
+      storeCachedObject(entry, objects[i]);
+    } else {
+      std::lock_guard<std::mutex> guard{errorsLock};
+      errors = joinErrors(std::move(errors), object.takeError());
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    seconds[i] = elapsed.count();
+  });
+  if (errors) {
+    return std::move(errors);
+  }
+
+  for (size_t i = 0; i < seconds.size(); ++i) {
+    string line;
+    raw_string_ostream{line} << "Partition " << i << ": " << format("%.3f", seconds[i])
+                             << "s" << (cached[i] ? " (cached)" : "");
+    printLine(line);
+  }
+  return objects;
+}
+
+
+static Error
+link(ArrayRef<string> objectFiles, std::string_view outputFile) {
   auto clang = findProgramByName("clang++");
   string opt("-O");
   opt += optLevel;
 
   if (!clang) {
-    report_fatal_error("Unable to find clang.");
+    return makeError("Unable to find clang.");
   }
-  vector<string> args{clang.get(), opt, "-o", std::string(outputFile), std::string(objectFile)};
+  vector<string> args{clang.get(), opt, "-o", std::string(outputFile)};
+  args.insert(args.end(), objectFiles.begin(), objectFiles.end());
 
   for (const auto& libPath : libPaths) {
     args.push_back("-L" + libPath);
@@ -216,11 +952,12 @@ link(std::string_view objectFile, std::string_view outputFile) {
 
   vector<llvm::StringRef> charArgs;
   charArgs.reserve(args.size());
+  string command;
   for (auto& arg : args) {
     charArgs.emplace_back(arg);
-    outs() << arg.c_str() << " ";
+    command += arg + " ";
   }
-  outs() << "\n";
+  printLine(command);
 
   string err;
   auto result = ExecuteAndWait(
@@ -232,34 +969,187 @@ link(std::string_view objectFile, std::string_view outputFile) {
       0,
       &err
     );
-  if (-1 == result) {
-    report_fatal_error("Unable to link output file.");
+  if (0 != result) {
+    return makeError("Unable to link " + Twine{outputFile}
+                     + (err.empty() ? "" : ":\n " + err));
   }
+  return Error::success();
 }
 
 
-static void
+#ifdef CALLCOUNTER_HAVE_LLD
+// lld only reads its inputs from paths, so objects in memory are passed as
+// anonymous files that never reach the disk.
+static int
+createMemoryFile(ArrayRef<char> contents) {
+  int fd = memfd_create("callcounter-object", MFD_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  for (size_t written = 0; written < contents.size();) {
+    auto result = write(fd, contents.data() + written, contents.size() - written);
+    if (result <= 0) {
+      close(fd);
+      return -1;
+    }
+    written += result;
+  }
+  return fd;
+}
+
+
+// lld may fail to reset its state after a link. The remaining programs, e.g.
+// in batch mode, are then linked by the external driver.
+static std::atomic<bool> lldCanRunAgain{true};
+
+
+// Links the objects with lld in process, using the startup files and implicit
+// libraries that the C++ compiler reported when the tool was configured.
+// Returns false when the external driver should link instead.
+static Expected<bool>
+linkInProcess(ArrayRef<SmallVector<char, 0>> objects,
+              std::string_view outputFile) {
+  if (!lldCanRunAgain) {
+    return false;
+  }
+
+  // The startup files are those of position independent executables.
+  auto relocationModel = codegen::getExplicitRelocModel();
+  if (relocationModel && Reloc::Model::PIC_ != *relocationModel) {
+    return false;
+  }
+
+  vector<int> fds;
+  auto closeAll = make_scope_exit([&fds] {
+    for (int fd : fds) {
+      close(fd);
+    }
+  });
+
+  vector<string> args{"ld.lld", "-o", string(outputFile), "-pie",
+                      "--eh-frame-hdr", "-dynamic-linker", CALLCOUNTER_DYNAMIC_LINKER};
+  for (const char* startFile : {CALLCOUNTER_LINK_START_FILES}) {
+    args.push_back(startFile);
+  }
+  for (auto& object : objects) {
+    int fd = createMemoryFile(object);
+    if (fd < 0) {
+      return false;
+    }
+    fds.push_back(fd);
+    args.push_back("/proc/self/fd/" + std::to_string(fd));
+  }
+  for (const auto& libPath : libPaths) {
+    args.push_back("-L" + libPath);
+  }
+  for (const char* libPath : {CALLCOUNTER_IMPLICIT_LINK_DIRS}) {
+    args.push_back(string("-L") + libPath);
+  }
+  for (const auto& library : libraries) {
+    args.push_back("-l" + library);
+  }
+  // Some compilers report implicit libraries by their full paths.
+  for (const char* library : {CALLCOUNTER_IMPLICIT_LINK_LIBS}) {
+    args.push_back(sys::path::is_absolute(library) ? string(library)
+                                                   : string("-l") + library);
+  }
+  for (const char* endFile : {CALLCOUNTER_LINK_END_FILES}) {
+    args.push_back(endFile);
+  }
+
+  vector<const char*> charArgs;
+  charArgs.reserve(args.size());
+  string command;
+  for (auto& arg : args) {
+    charArgs.push_back(arg.c_str());
+    command += arg + " ";
+  }
+  printLine(command);
+
+  // lld keeps global state, so only one link may run in process at a time.
+  static std::mutex lldLock;
+  std::lock_guard<std::mutex> guard{lldLock};
+  if (!lldCanRunAgain) {
+    return false;
+  }
+  auto result = lld::lldMain(charArgs, outs(), errs(), {{lld::Gnu, &lld::elf::link}});
+  lldCanRunAgain = result.canRunAgain;
+  if (result.retCode) {
+    return makeError("Unable to link " + Twine{outputFile});
+  }
+  return true;
+}
+#endif
+
+
+static Error
 generateBinary(Module& m, std::string_view outputFilename) {
+  // Separately instrumented translation units and shared libraries are
+  // linked by the build of the program, which adds the runtime.
+  if (compileOnly) {
+    callcounter::PhaseTimer timer{phaseStats, "compile"};
+    auto object = compile(m);
+    if (!object) {
+      return object.takeError();
+    }
+    return writeObjectFile(*object, string(outputFilename));
+  }
+
+  vector<SmallVector<char, 0>> objects;
+  {
+    callcounter::PhaseTimer timer{phaseStats, "compile"};
+    if (codegenPartitions > 1) {
+      auto partitions = compileInPartitions(m);
+      if (!partitions) {
+        return partitions.takeError();
+      }
+      objects = std::move(*partitions);
+    } else {
+      auto object = compile(m);
+      if (!object) {
+        return object.takeError();
+      }
+      objects.push_back(std::move(*object));
+    }
+  }
+
+  callcounter::PhaseTimer timer{phaseStats, "link"};
+#ifdef CALLCOUNTER_HAVE_LLD
+  if (!externalLinker) {
+    auto linked = linkInProcess(objects, outputFilename);
+    if (!linked || *linked) {
+      return linked.takeError();
+    }
+  }
+#endif
+
   // Compiling to native should allow things to keep working even when the
   // version of clang on the system and the version of LLVM used to compile
   // the tool don't quite match up.
-  SmallString<256> objectFile(outputFilename);
-  objectFile.append(".o");
-  compile(m, objectFile.str());
-  link(objectFile.str(), outputFilename);
+  vector<string> objectFiles;
+  for (size_t i = 0; i < objects.size(); ++i) {
+    objectFiles.push_back(string(outputFilename)
+                          + (objects.size() > 1 ? "." + std::to_string(i) : "")
+                          + ".o");
+    if (auto error = writeObjectFile(objects[i], objectFiles.back())) {
+      return error;
+    }
+  }
+  return link(objectFiles, outputFilename);
 }
 
 
-static void
+static Error
 saveModule(Module const& m, std::string_view filename) {
   std::error_code errc;
   raw_fd_ostream out(filename.data(), errc, sys::fs::OF_None);
 
   if (errc) {
-    report_fatal_error("error saving llvm module to '" + filename + "': \n"
-                       + errc.message());
+    return makeError("error saving llvm module to '" + Twine{filename} + "': \n"
+                     + errc.message());
   }
   WriteBitcodeToFile(m, out);
+  return Error::success();
 }
 
 
@@ -286,34 +1176,345 @@ prepareLinkingPaths(SmallString<32> invocationPath) {
 #endif
   libraries.push_back(RUNTIME_LIB);
   libraries.push_back("rt");
+  libraries.push_back("pthread");
+  libraries.push_back("dl");
 }
 
 
 static void
-instrumentForDynamicCount(Module& m) {
+initializeCodeGen() {
   InitializeAllTargets();
   InitializeAllTargetMCs();
   InitializeAllAsmPrinters();
   InitializeAllAsmParsers();
   cl::AddExtraVersionPrinter(TargetRegistry::printRegisteredTargetsForVersion);
+}
 
-  if (outFile.getValue().empty()) {
-    report_fatal_error("-o command line option must be specified.\n");
+
+static std::vector<GlobPattern>
+parsePatterns(ArrayRef<string> patterns) {
+  std::vector<GlobPattern> parsed;
+  for (auto& pattern : patterns) {
+    auto glob = GlobPattern::create(pattern);
+    if (!glob) {
+      report_fatal_error(Twine{"Invalid pattern '" + pattern + "': "}
+                         + toString(glob.takeError()));
+    }
+    parsed.push_back(std::move(*glob));
   }
+  return parsed;
+}
 
-  // Build up all of the passes that we want to run on the module.
-  // If we used non-Module level passes, we would need to wire them together.
-  ModuleAnalysisManager mam;
-  PassBuilder pb;
-  pb.registerModuleAnalyses(mam);
 
+// Collects the options of the instrumentation once, so that batch mode does
+// not read the selection profiles for every input.
+static const callcounter::DynamicCallCounterOptions&
+getDynamicOptions() {
+  static const auto options = [] {
+    callcounter::DynamicCallCounterOptions options;
+    options.update            = counterUpdate;
+    options.mode              = counterMode;
+    options.coalesce          = coalesceCounters;
+    options.promoteLoops      = promoteLoopCounters;
+    options.sampling          = samplingMode;
+    options.samplePeriod      = std::max<uint64_t>(samplePeriod, 1);
+    options.profileIndirect   = profileIndirect;
+    options.countEdges        = countEdges;
+    options.continuous        = continuousMode;
+    options.timing            = AnalysisType::TIMING == analysisType;
+    options.latencyHistograms = latencyHistograms;
+    options.allow             = parsePatterns(allowPatterns);
+    options.deny              = parsePatterns(denyPatterns);
+    options.minInstructions   = minInstructions;
+
+    if (latencyHistograms && !options.timing) {
+      report_fatal_error("-latency-histograms requires -timing.\n");
+    }
+    if (maxCalls && selectionProfiles.empty()) {
+      report_fatal_error("-max-calls requires -selection-profile.\n");
+    }
+    if (!selectionProfiles.empty()) {
+      auto merged = callcounter::mergeProfiles(selectionProfiles);
+      if (!merged) {
+        report_fatal_error(Twine{"Error reading selection profiles: "}
+                           + toString(merged.takeError()));
+      }
+      for (size_t id = 0; id < merged->names.size(); ++id) {
+        options.profileCounts[merged->names[id]] = merged->counts[id];
+      }
+      options.maxCalls = maxCalls;
+    }
+    return options;
+  }();
+  return options;
+}
+
+
+// Runs a pipeline in the syntax of `opt -passes` as a phase of its own.
+static Error
+runPipeline(PassBuilder& pb,
+            ModuleAnalysisManager& mam,
+            Module& m,
+            StringRef phase,
+            StringRef pipeline) {
+  if (pipeline.empty()) {
+    return Error::success();
+  }
   ModulePassManager mpm;
-  mpm.addPass(callcounter::DynamicCallCounter());
-  mpm.addPass(VerifierPass());
+  if (auto error = pb.parsePassPipeline(mpm, pipeline)) {
+    return makeError("Invalid pipeline '" + pipeline + "': "
+                     + toString(std::move(error)));
+  }
+  callcounter::PhaseTimer timer{phaseStats, phase};
   mpm.run(m, mam);
+  return Error::success();
+}
+
+
+static Error
+instrumentModule(Module& m) {
+  // The optimization pipelines tune their passes for the target.
+  auto machine = createTargetMachine(Triple(m.getTargetTriple()));
+  if (!machine) {
+    return machine.takeError();
+  }
+  m.setDataLayout((*machine)->createDataLayout());
+
+  // Build up all of the passes that we want to run on the module, with the
+  // analyses that the optimization pipelines may need.
+  LoopAnalysisManager lam;
+  FunctionAnalysisManager fam;
+  CGSCCAnalysisManager cgam;
+  ModuleAnalysisManager mam;
+  PassBuilder pb{machine->get()};
+  pb.registerModuleAnalyses(mam);
+  pb.registerCGSCCAnalyses(cgam);
+  pb.registerFunctionAnalyses(fam);
+  pb.registerLoopAnalyses(lam);
+  pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+  auto& options = getDynamicOptions();
+
+  // Continuous profiles hold the counts exactly as they are updated, so they
+  // cannot include counts that are only completed when the program exits or
+  // when a loop is left, which a long running service may never do.
+  if (continuousMode
+      && (callcounter::CounterMode::THREAD_LOCAL == counterMode
+          || callcounter::SamplingMode::WINDOW == samplingMode || countEdges
+          || promoteLoopCounters)) {
+    return makeError("-continuous cannot be combined with thread local "
+                     "counters, window sampling, edge counts, or loop "
+                     "promotion.");
+  }
 
-  generateBinary(m, outFile);
-  saveModule(m, outFile + ".callcounter.bc");
+  // Optimizing first means that only the calls that survive inlining are
+  // counted, as in the uninstrumented program. Optimizing afterward cleans up
+  // the counter updates themselves.
+  if (auto error = runPipeline(pb, mam, m, "pre-passes", prePasses)) {
+    return error;
+  }
+  {
+    callcounter::PhaseTimer timer{phaseStats, "instrument"};
+    callcounter::DynamicCallCounter counter{options};
+    mam.invalidate(m, counter.run(m, mam));
+    if (phaseStats.enabled) {
+      phaseStats.numCounters += counter.ids.size() + counter.edgeIDs.size();
+    }
+  }
+  if (auto error = runPipeline(pb, mam, m, "post-passes", postPasses)) {
+    return error;
+  }
+  {
+    // The verifier pass aborts on a broken module, so the module is checked
+    // directly to report it as a failure of this input.
+    callcounter::PhaseTimer timer{phaseStats, "verify"};
+    string problems;
+    raw_string_ostream out{problems};
+    if (verifyModule(m, &out)) {
+      return makeError("Instrumented module is broken:\n" + problems);
+    }
+  }
+  phaseStats.addModule("instrumented", m);
+  return Error::success();
+}
+
+
+static Error
+instrumentForDynamicCount(Module& m, StringRef outPath) {
+  if (auto error = instrumentModule(m)) {
+    return error;
+  }
+
+  // Save the module first, as splitting it for code generation renames its
+  // local symbols.
+  {
+    callcounter::PhaseTimer timer{phaseStats, "save"};
+    if (auto error = saveModule(m, (outPath + ".callcounter.bc").str())) {
+      return error;
+    }
+  }
+  return generateBinary(m, outPath);
+}
+
+
+// Instruments the module and runs its main function in process with a JIT,
+// skipping code generation to a file and linking. The runtime is built into
+// the tool, so the counts are reported when the tool exits, just as the
+// instrumented program would report them.
+static int
+runInstrumented(StringRef inPath, ArrayRef<string> programArgs) {
+  // JIT linked code cannot access thread local storage without the ORC
+  // runtime, which is not available here.
+  if (callcounter::CounterMode::THREAD_LOCAL == counterMode
+      || callcounter::SamplingMode::COUNTDOWN == samplingMode) {
+    errs() << "-run does not support thread local counters or countdown "
+              "sampling.\n";
+    return EXIT_FAILURE;
+  }
+
+  SMDiagnostic err;
+  auto context = std::make_unique<LLVMContext>();
+  unique_ptr<Module> module;
+  {
+    callcounter::PhaseTimer timer{phaseStats, "parse"};
+    module = parseIRFile(inPath, err, *context);
+  }
+  if (!module) {
+    errs() << "Error reading bitcode file: " << inPath << "\n";
+    err.print("callcounter", errs());
+    return EXIT_FAILURE;
+  }
+  phaseStats.addModule("input", *module);
+
+  ExitOnError exitOnError{"Unable to run " + inPath.str() + ": "};
+  exitOnError(instrumentModule(*module));
+  std::optional<callcounter::PhaseTimer> timer{std::in_place, phaseStats, "jit"};
+  auto jit  = exitOnError(orc::LLJITBuilder().create());
+  auto& lib = jit->getMainJITDylib();
+  lib.addGenerator(exitOnError(orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+      jit->getDataLayout().getGlobalPrefix())));
+  exitOnError(jit->addIRModule(orc::ThreadSafeModule(std::move(module),
+                                                     std::move(context))));
+
+  // Running the constructors registers the counters, and running the
+  // destructors afterward keeps their counts once the JIT is gone.
+  using MainFunction = int (*)(int, char*[]);
+  auto mainFunction  = exitOnError(jit->lookup("main")).toPtr<MainFunction>();
+  exitOnError(jit->initialize(lib));
+  timer.emplace(phaseStats, "run");
+  int result = orc::runAsMain(mainFunction, programArgs, inPath);
+  exitOnError(jit->deinitialize(lib));
+  return result;
+}
+
+
+// The outcome of instrumenting one input in batch mode.
+struct BatchResult {
+  bool succeeded = false;
+  bool cached    = false;
+  double seconds = 0;
+  string message;
+};
+
+
+// Each program is named after its input, either next to the input or within
+// the output directory.
+static string
+getBatchOutputPath(StringRef inPath) {
+  SmallString<128> path{outFile.getValue()};
+  if (path.empty()) {
+    path = inPath;
+    sys::path::replace_extension(path, "");
+  } else {
+    sys::path::append(path, sys::path::stem(inPath));
+  }
+  if (compileOnly) {
+    path += ".o";
+  }
+  return path.str().str();
+}
+
+
+// Instruments every input as a separate program. Each is loaded into its own
+// context and instrumented, compiled, and linked on the thread pool. Inputs
+// that cannot be loaded, instrumented, compiled, or linked are reported in the
+// summary without stopping the others.
+static int
+instrumentBatch(ArrayRef<string> paths, StringRef invocationPath) {
+  using Clock = std::chrono::steady_clock;
+
+  if (!outFile.getValue().empty()) {
+    if (auto errc = sys::fs::create_directories(outFile)) {
+      errs() << "Unable to create " << outFile << ": " << errc.message() << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  vector<string> outPaths;
+  StringSet<> seen;
+  for (auto& path : paths) {
+    outPaths.push_back(getBatchOutputPath(path));
+    if (!seen.insert(outPaths.back()).second) {
+      errs() << "Several inputs would be written to " << outPaths.back() << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Invalid options are reported once, before any input is instrumented.
+  getDynamicOptions();
+
+  auto start = Clock::now();
+  vector<BatchResult> results(paths.size());
+  parallelFor(0, paths.size(), [&](size_t i) {
+    auto begin   = Clock::now();
+    auto& result = results[i];
+
+    auto entry = getBuildCachePath(paths[i], invocationPath);
+    if (restoreFromBuildCache(entry, outPaths[i])) {
+      result.succeeded = true;
+      result.cached    = true;
+      std::chrono::duration<double> elapsed = Clock::now() - begin;
+      result.seconds = elapsed.count();
+      return;
+    }
+
+    SMDiagnostic err;
+    LLVMContext context;
+    auto module = parseIRFile(paths[i], err, context);
+    if (!module) {
+      raw_string_ostream message{result.message};
+      err.print(nullptr, message, false);
+    } else if (auto error = instrumentForDynamicCount(*module, outPaths[i])) {
+      result.message = toString(std::move(error));
+    } else {
+      storeInBuildCache(entry, outPaths[i]);
+      result.succeeded = true;
+    }
+
+    std::chrono::duration<double> elapsed = Clock::now() - begin;
+    result.seconds = elapsed.count();
+  });
+  std::chrono::duration<double> elapsed = Clock::now() - start;
+
+  size_t succeeded = 0;
+  outs() << "=============\n"
+         << "Batch Summary\n"
+         << "=============\n";
+  for (size_t i = 0; i < paths.size(); ++i) {
+    auto& result = results[i];
+    succeeded += result.succeeded;
+    auto status = result.cached ? "cached " : result.succeeded ? "ok     " : "FAILED ";
+    outs() << status << paths[i] << " -> "
+           << outPaths[i] << " (" << format("%.3f", result.seconds) << "s)\n";
+    SmallVector<StringRef, 4> lines;
+    StringRef(result.message).rtrim().split(lines, '\n', -1, false);
+    for (auto line : lines) {
+      outs() << "       " << line << "\n";
+    }
+  }
+  outs() << succeeded << " of " << paths.size() << " programs instrumented in "
+         << format("%.3f", elapsed.count()) << "s\n";
+  return succeeded == paths.size() ? 0 : EXIT_FAILURE;
 }
 
 
@@ -331,7 +1532,7 @@ struct StaticCountPrinter : public PassInfoMixin<StaticCountPrinter> {
 
 
 static void
-countStaticCalls(Module& m) {
+countStaticCalls(Module& m, raw_ostream& out) {
   // Build up all of the passes that we want to run on the module.
   ModuleAnalysisManager mam;
   PassBuilder pb;
@@ -340,11 +1541,306 @@ countStaticCalls(Module& m) {
   mam.registerPass([&] { return callcounter::StaticCallCounter(); });
 
   ModulePassManager mpm;
-  mpm.addPass(StaticCountPrinter(outs()));
+  mpm.addPass(StaticCountPrinter(out));
   mpm.run(m, mam);
 }
 
 
+static void
+countStaticCallsLazily(Module& m, raw_ostream& out) {
+  callcounter::StaticCallCounts counts;
+  if (auto error = counts.analyzeLazily(m)) {
+    report_fatal_error(Twine("Error loading function bodies: ")
+                       + toString(std::move(error)));
+  }
+  counts.print(out);
+}
+
+
+static int
+estimateCalls(Module& m, raw_ostream& out) {
+  // Build up the analyses, including the block frequencies of each function.
+  LoopAnalysisManager lam;
+  FunctionAnalysisManager fam;
+  CGSCCAnalysisManager cgam;
+  ModuleAnalysisManager mam;
+  PassBuilder pb;
+  pb.registerModuleAnalyses(mam);
+  pb.registerCGSCCAnalyses(cgam);
+  pb.registerFunctionAnalyses(fam);
+  pb.registerLoopAnalyses(lam);
+  pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+  mam.registerPass([&] { return callcounter::StaticCallEstimator(); });
+  std::optional<callcounter::PhaseTimer> timer{std::in_place, phaseStats, "estimate"};
+  auto& estimates = mam.getResult<callcounter::StaticCallEstimator>(m);
+  timer.reset();
+
+  if (compareProfiles.empty()) {
+    estimates.print(out);
+    return 0;
+  }
+  auto merged = callcounter::mergeProfiles(compareProfiles);
+  if (!merged) {
+    errs() << "Error reading profiles: " << toString(merged.takeError()) << "\n";
+    return EXIT_FAILURE;
+  }
+  estimates.printComparison(out, merged->names, merged->counts, topCount);
+  return 0;
+}
+
+
+// Attaches the calls measured in the profiles to the uninstrumented module and
+// compiles it with the optimization pipeline of the -O level, so that inlining
+// and the placement of hot and cold functions follow the measured calls.
+static int
+optimizeWithProfile(Module& m, StringRef outPath) {
+  auto merged = callcounter::mergeProfiles(profileUse);
+  if (!merged) {
+    errs() << "Error reading profiles: " << toString(merged.takeError()) << "\n";
+    return EXIT_FAILURE;
+  }
+  StringMap<uint64_t> counts;
+  for (size_t id = 0; id < merged->names.size(); ++id) {
+    counts[merged->names[id]] = merged->counts[id];
+  }
+
+  // Functions are matched by name, so report how many were found to catch
+  // profiles of other programs.
+  size_t numDefined  = 0;
+  size_t numProfiled = 0;
+  for (auto& f : m) {
+    if (!f.isDeclaration()) {
+      ++numDefined;
+      numProfiled += counts.count(f.getName());
+    }
+  }
+  outs() << "Profiled functions: " << numProfiled << " of " << numDefined << "\n";
+
+  auto machine = createTargetMachine(Triple(m.getTargetTriple()));
+  if (!machine) {
+    errs() << toString(machine.takeError()) << "\n";
+    return EXIT_FAILURE;
+  }
+  m.setDataLayout((*machine)->createDataLayout());
+
+  LoopAnalysisManager lam;
+  FunctionAnalysisManager fam;
+  CGSCCAnalysisManager cgam;
+  ModuleAnalysisManager mam;
+  PassBuilder pb{machine->get()};
+  pb.registerModuleAnalyses(mam);
+  pb.registerCGSCCAnalyses(cgam);
+  pb.registerFunctionAnalyses(fam);
+  pb.registerLoopAnalyses(lam);
+  pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+  {
+    callcounter::PhaseTimer timer{phaseStats, "annotate"};
+    callcounter::CallProfileAnnotator annotator{std::move(counts)};
+    mam.invalidate(m, annotator.run(m, mam));
+  }
+  auto error = runPipeline(pb, mam, m, "optimize", "default<O" + string(1, optLevel) + ">");
+  if (!error) {
+    error = runPipeline(pb, mam, m, "verify", "verify");
+  }
+  if (!error) {
+    phaseStats.addModule("optimized", m);
+    error = generateBinary(m, outPath);
+  }
+  if (error) {
+    errs() << toString(std::move(error)) << "\n";
+    return EXIT_FAILURE;
+  }
+  return 0;
+}
+
+
+// Changing the report format must change this, so that stale entries are not
+// reused.
+static constexpr StringLiteral STATIC_CACHE_VERSION = "callcounter-static-1";
+
+
+// The static report only depends on the input, so the cache is keyed by a
+// hash of its contents. A hit skips parsing entirely.
+static std::string
+getStaticCachePath(StringRef inPath) {
+  auto buffer = MemoryBuffer::getFile(inPath);
+  if (!buffer) {
+    return "";
+  }
+
+  MD5 hash;
+  hash.update(STATIC_CACHE_VERSION);
+  hash.update((*buffer)->getBuffer());
+  MD5::MD5Result result;
+  hash.final(result);
+
+  SmallString<128> path{staticCache.getValue()};
+  sys::path::append(path, result.digest());
+  path += ".txt";
+  return path.str().str();
+}
+
+
+// Writes a cache entry through a temporary file, so that concurrent builds
+// never read a partial report. Failures only cost the reuse.
+static void
+storeStaticCache(StringRef path, StringRef report) {
+  int fd = -1;
+  SmallString<128> tempPath;
+  auto errc = sys::fs::create_directories(sys::path::parent_path(path));
+  if (!errc) {
+    errc = sys::fs::createUniqueFile(path + ".tmp%%%%%%", fd, tempPath);
+  }
+  if (!errc) {
+    raw_fd_ostream out(fd, true);
+    out << report;
+    out.close();
+    errc = out.has_error() ? out.error() : sys::fs::rename(tempPath, path);
+  }
+  if (errc) {
+    errs() << "Warning: unable to update the static cache: " << errc.message()
+           << "\n";
+    if (!tempPath.empty()) {
+      sys::fs::remove(tempPath);
+    }
+  }
+}
+
+
+// Shows what lazy loading saves, apart from the report so that its format
+// stays the same. -phase-stats reports the peak memory of every phase.
+static void
+printPeakMemory(raw_ostream& out) {
+  rusage usage;
+  if (0 == getrusage(RUSAGE_SELF, &usage)) {
+    out << "Peak memory: " << usage.ru_maxrss / 1024 << " MiB\n";
+  }
+}
+
+
+static int
+mergeProfiles(ArrayRef<string> paths) {
+  std::optional<callcounter::PhaseTimer> timer{std::in_place, phaseStats, "merge"};
+  auto merged = callcounter::mergeProfiles(paths);
+  timer.reset();
+  if (!merged) {
+    errs() << "Error merging profiles: " << toString(merged.takeError()) << "\n";
+    return EXIT_FAILURE;
+  }
+
+  if (!outFile.getValue().empty()) {
+    if (auto error = merged->write(outFile)) {
+      errs() << toString(std::move(error)) << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  merged->print(outs(), topCount);
+  return 0;
+}
+
+
+// Copies the counts of a profile, which may be mapped from a file that the
+// profiled program is still updating.
+static Expected<vector<uint64_t>>
+takeSnapshot(StringRef path, vector<StringRef>& names, ProfileFile& file) {
+  auto profile = ProfileFile::open(path);
+  if (!profile) {
+    return profile.takeError();
+  }
+  file  = std::move(*profile);
+  names = file.getNames();
+  return vector<uint64_t>(file.counts.begin(), file.counts.end());
+}
+
+
+// Reports the call rates of a continuous profile written by a running program,
+// from the differences between snapshots taken at a fixed interval.
+static int
+watchProfile(StringRef path) {
+  using Clock = std::chrono::steady_clock;
+
+  ProfileFile file;
+  vector<StringRef> names;
+  auto previous = takeSnapshot(path, names, file);
+  auto last     = Clock::now();
+  for (unsigned report = 0; previous && (!watchReports || report < watchReports);
+       ++report) {
+    std::this_thread::sleep_for(std::chrono::duration<double>(watchInterval));
+    auto current = takeSnapshot(path, names, file);
+    auto now     = Clock::now();
+    if (!current) {
+      previous = std::move(current);
+      break;
+    }
+
+    // A restarted program starts counting from zero again.
+    auto& before = *previous;
+    auto& after  = *current;
+    vector<uint64_t> deltas(after.size());
+    for (size_t id = 0; id < after.size(); ++id) {
+      bool restarted = before.size() != after.size() || after[id] < before[id];
+      deltas[id]     = restarted ? after[id] : after[id] - before[id];
+    }
+
+    vector<size_t> order(deltas.size());
+    std::iota(order.begin(), order.end(), 0);
+    auto top = std::min<size_t>(topCount, order.size());
+    std::partial_sort(order.begin(),
+                      order.begin() + top,
+                      order.end(),
+                      [&deltas](size_t a, size_t b) { return deltas[a] > deltas[b]; });
+
+    std::chrono::duration<double> elapsed = now - last;
+    outs() << "Calls per second over " << format("%.2f", elapsed.count()) << "s\n"
+           << "===========================\n";
+    for (auto id : ArrayRef<size_t>(order).take_front(top)) {
+      outs() << names[id] << ": " << format("%.1f", deltas[id] / elapsed.count())
+             << " (" << after[id] << " total)\n";
+    }
+    outs().flush();
+
+    previous = std::move(current);
+    last     = now;
+  }
+
+  if (!previous) {
+    errs() << "Error watching profile: " << toString(previous.takeError()) << "\n";
+    return EXIT_FAILURE;
+  }
+  return 0;
+}
+
+
+static void
+reportPhaseStats() {
+  if (!phaseStats.enabled) {
+    return;
+  }
+  std::error_code errc;
+  unique_ptr<raw_fd_ostream> file;
+  if (!phaseStatsFile.empty()) {
+    file = std::make_unique<raw_fd_ostream>(phaseStatsFile, errc, sys::fs::OF_Text);
+    if (errc) {
+      errs() << "Unable to write phase statistics to '" << phaseStatsFile
+             << "': " << errc.message() << "\n";
+      return;
+    }
+  }
+
+  // Reports on stdout come first.
+  outs().flush();
+  auto& out = file ? *file : errs();
+  if (StatsFormat::JSON == phaseStatsFormat) {
+    phaseStats.printJSON(out);
+  } else {
+    phaseStats.print(out);
+  }
+}
+
+
 int
 main(int argc, char** argv) {
   // This boilerplate provides convenient stack traces and clean LLVM exit
@@ -354,24 +1850,176 @@ main(int argc, char** argv) {
   llvm::PrettyStackTraceProgram X(argc, argv);
   llvm_shutdown_obj shutdown;
   cl::HideUnrelatedOptions(callCounterCategory);
-  cl::ParseCommandLineOptions(argc, argv);
+
+  // Arguments after -- belong to the program run with -run.
+  auto separator = std::find_if(argv + 1, argv + argc, [](const char* arg) {
+    return StringRef(arg) == "--";
+  });
+  vector<string> programArgs(std::min(separator + 1, argv + argc), argv + argc);
+  cl::ParseCommandLineOptions(separator - argv, argv);
+
+  if (numJobs) {
+    parallel::strategy = hardware_concurrency(numJobs);
+  }
+
+  phaseStats.enabled = StatsFormat::NONE != phaseStatsFormat;
+  auto statsReporter = make_scope_exit(reportPhaseStats);
+
+  // The cache is pruned on the way out, at most once per interval of the
+  // policy.
+  auto cachePolicy = parseCachePruningPolicy(buildCachePolicy);
+  if (!cachePolicy) {
+    errs() << "Invalid -build-cache-policy: " << toString(cachePolicy.takeError())
+           << "\n";
+    return EXIT_FAILURE;
+  }
+  auto cachePruner = make_scope_exit([&cachePolicy] {
+    if (!buildCache.empty()) {
+      pruneCache(buildCache, *cachePolicy);
+    }
+  });
+
+  if (AnalysisType::MERGE == analysisType) {
+    return mergeProfiles(inPaths);
+  }
+
+  if (AnalysisType::WATCH == analysisType) {
+    if (inPaths.size() != 1) {
+      errs() << "Exactly one profile must be given to watch.\n";
+      return EXIT_FAILURE;
+    }
+    return watchProfile(inPaths.front());
+  }
+
+  if (!programArgs.empty() && !runInProcess) {
+    errs() << "Arguments after -- are only passed to programs run with -run.\n";
+    return EXIT_FAILURE;
+  }
+
+  // An object file holds the code of a single partition.
+  if (compileOnly && (runInProcess || codegenPartitions > 1)) {
+    errs() << "-c cannot be combined with -run or -codegen-partitions.\n";
+    return EXIT_FAILURE;
+  }
+
+  if (batchMode) {
+    if (!isInstrumenting()) {
+      errs() << "-batch is only supported with -dynamic or -timing.\n";
+      return EXIT_FAILURE;
+    }
+    if (runInProcess || phaseStats.enabled) {
+      errs() << "-run and -phase-stats cannot be combined with -batch.\n";
+      return EXIT_FAILURE;
+    }
+    prepareLinkingPaths(StringRef(argv[0]));
+    initializeCodeGen();
+    return instrumentBatch(inPaths, argv[0]);
+  }
+
+  if (inPaths.size() != 1) {
+    errs() << "Exactly one module must be given for analysis.\n";
+    return EXIT_FAILURE;
+  }
+  auto& inPath = inPaths.front();
+
+  if (runInProcess) {
+    if (!isInstrumenting()) {
+      errs() << "-run is only supported with -dynamic or -timing.\n";
+      return EXIT_FAILURE;
+    }
+    initializeCodeGen();
+    return runInstrumented(inPath, programArgs);
+  }
+
+  // Building the same input with the same options reuses the earlier program.
+  string buildEntry;
+  if (isInstrumenting() || AnalysisType::OPTIMIZE == analysisType) {
+    prepareLinkingPaths(StringRef(argv[0]));
+    buildEntry = getBuildCachePath(inPath, argv[0]);
+    if (!outFile.getValue().empty() && restoreFromBuildCache(buildEntry, outFile)) {
+      printLine("Reused " + buildEntry);
+      return 0;
+    }
+  }
+
+  std::string cachePath;
+  if (AnalysisType::STATIC == analysisType && !staticCache.empty()) {
+    callcounter::PhaseTimer timer{phaseStats, "cache"};
+    cachePath   = getStaticCachePath(inPath);
+    auto cached = MemoryBuffer::getFile(cachePath);
+    if (!cachePath.empty() && cached) {
+      outs() << (*cached)->getBuffer();
+      return 0;
+    }
+  }
 
   // Construct an IR file from the filename passed on the command line.
   SMDiagnostic err;
   LLVMContext context;
-  unique_ptr<Module> module = parseIRFile(inPath.getValue(), err, context);
+  bool lazy = AnalysisType::STATIC == analysisType && lazyLoad;
+  unique_ptr<Module> module;
+  {
+    callcounter::PhaseTimer timer{phaseStats, "parse"};
+    module = lazy ? getLazyIRFileModule(inPath, err, context, true)
+                  : parseIRFile(inPath, err, context);
+  }
 
   if (!module.get()) {
     errs() << "Error reading bitcode file: " << inPath << "\n";
     err.print(argv[0], errs());
     return EXIT_FAILURE;
   }
+  if (!lazy) {
+    phaseStats.addModule("input", *module);
+  }
 
-  if (AnalysisType::DYNAMIC == analysisType) {
-    prepareLinkingPaths(StringRef(argv[0]));
-    instrumentForDynamicCount(*module);
+  if (AnalysisType::ESTIMATE == analysisType) {
+    return estimateCalls(*module, outs());
+  }
+
+  if (AnalysisType::OPTIMIZE == analysisType) {
+    if (profileUse.empty() || outFile.getValue().empty()) {
+      report_fatal_error("-optimize requires -profile-use and -o.\n");
+    }
+    initializeCodeGen();
+    if (int result = optimizeWithProfile(*module, outFile)) {
+      return result;
+    }
+    storeInBuildCache(buildEntry, outFile);
+    return 0;
+  }
+
+  if (isInstrumenting()) {
+    if (outFile.getValue().empty()) {
+      report_fatal_error("-o command line option must be specified.\n");
+    }
+    initializeCodeGen();
+    if (auto error = instrumentForDynamicCount(*module, outFile)) {
+      errs() << toString(std::move(error)) << "\n";
+      return EXIT_FAILURE;
+    }
+    storeInBuildCache(buildEntry, outFile);
   } else {
-    countStaticCalls(*module);
+    std::string report;
+    raw_string_ostream reportOut{report};
+    {
+      callcounter::PhaseTimer timer{phaseStats, "count"};
+      if (lazy) {
+        countStaticCallsLazily(*module, reportOut);
+      } else {
+        countStaticCalls(*module, reportOut);
+      }
+    }
+    reportOut.flush();
+
+    outs() << report;
+    if (!cachePath.empty()) {
+      callcounter::PhaseTimer timer{phaseStats, "cache"};
+      storeStaticCache(cachePath, report);
+    }
+    if (lazy) {
+      printPeakMemory(errs());
+    }
   }
 
   return 0;